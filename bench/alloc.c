@@ -0,0 +1,31 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Counts every heap allocation, libc's own included, for pwr bench. Only linked into pwr-bench;
+// it relies on glibc exporting its allocator as __libc_malloc() and friends.
+
+#include <stddef.h>
+
+extern void* __libc_malloc (size_t size);
+extern void* __libc_calloc (size_t count, size_t size);
+extern void* __libc_realloc (void* ptr, size_t size);
+
+unsigned long pwr_allocations = 0;
+
+void* malloc (size_t size) {
+    __atomic_add_fetch(&pwr_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc (size_t count, size_t size) {
+    __atomic_add_fetch(&pwr_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void* realloc (void* ptr, size_t size) {
+    __atomic_add_fetch(&pwr_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
@@ -0,0 +1,124 @@
+#!/bin/sh
+# pwr: Power-saving-mode controller for linux laptops.
+# Copyright 2018 Ethan McTague.
+# Licensed under the MIT license. See LICENSE for full license text.
+# https://github.com/emctague/pwr
+#
+# Build a fake system for pwr --root: CPUS CPUs with intel_pstate, DEVICES PCI and USB
+# devices, a SATA host and disk for every 8 devices, and perform/powersave profiles that use all
+# of it. Helper programs are stubs that do nothing.
+#
+# usage: mktree.sh DIR CPUS DEVICES
+
+set -e
+
+root=$1
+cpus=${2:-4}
+devices=${3:-16}
+
+[ -n "$root" ] || { echo "usage: $0 DIR CPUS DEVICES" >&2; exit 2; }
+rm -rf "$root"
+mkdir -p "$root"
+cd "$root"
+
+# put FILE VALUE
+put () {
+    mkdir -p "$(dirname "$1")"
+    printf '%s\n' "$2" > "$1"
+}
+
+cpu=sys/devices/system/cpu
+for i in $(seq 0 $((cpus - 1))); do
+    policy=$cpu/cpufreq/policy$i
+    put $policy/scaling_driver intel_pstate
+    put $policy/scaling_governor powersave
+    put $policy/scaling_available_governors "performance powersave"
+    put $policy/energy_performance_preference balance_performance
+    put $policy/energy_performance_available_preferences "default performance balance_performance balance_power power"
+    put $policy/scaling_min_freq 400000
+    put $policy/scaling_max_freq 4000000
+    put $policy/scaling_cur_freq 1800000
+    mkdir -p $cpu/cpu$i
+    ln -s ../cpufreq/policy$i $cpu/cpu$i/cpufreq
+    s=0
+    for state in POLL C1 C6; do
+        put $cpu/cpu$i/cpuidle/state$s/name $state
+        put $cpu/cpu$i/cpuidle/state$s/time 0
+        s=$((s + 1))
+    done
+    [ $i -eq 0 ] || put $cpu/cpu$i/online 1
+done
+
+put $cpu/intel_pstate/no_turbo 0
+put $cpu/intel_pstate/min_perf_pct 10
+put $cpu/intel_pstate/max_perf_pct 100
+
+# The boot GPU, then the rest of the PCI bus.
+for i in $(seq 0 $((devices - 1))); do
+    pci=sys/bus/pci/devices/0000:$(printf '%02x' $((i / 8))):$(printf '%02x' $((i % 8))).0
+    put $pci/vendor 0x8086
+    put $pci/device $(printf '0x%04x' $i)
+    put $pci/class $([ $i -eq 0 ] && echo 0x030000 || echo 0x028000)
+    put $pci/power/control on
+    [ $i -ne 0 ] || put $pci/boot_vga 1
+
+    usb=sys/bus/usb/devices/1-$i
+    put $usb/idVendor 046d
+    put $usb/idProduct $(printf '%04x' $i)
+    put $usb/power/control on
+    put $usb/power/autosuspend_delay_ms 2000
+done
+
+for i in $(seq 0 $(((devices - 1) / 8))); do
+    put sys/class/scsi_host/host$i/link_power_management_policy max_performance
+
+    disk=sys/block/sd$i
+    mkdir -p $disk/device
+    put $disk/queue/scheduler "[mq-deadline] kyber bfq none"
+    put $disk/queue/read_ahead_kb 128
+done
+
+put sys/module/pcie_aspm/parameters/policy "[default] performance powersave powersupersave"
+put sys/module/snd_hda_intel/parameters/power_save 0
+mkdir -p sys/class/net/wlan0
+
+put proc/sys/vm/dirty_writeback_centisecs 500
+put proc/sys/vm/dirty_expire_centisecs 3000
+put proc/sys/vm/laptop_mode 0
+put proc/sys/kernel/random/boot_id 00000000-0000-0000-0000-000000000000
+
+mkdir -p sbin run var/lib var/cache
+printf '#!/bin/sh\nexit 0\n' > sbin/iwconfig
+chmod +x sbin/iwconfig
+
+put etc/pwr/profiles.d/perform.conf "governor = performance
+epp = performance
+turbo = on
+max_perf_pct = 100
+wifi = off
+pci_pm = on
+usb_pm = on
+usb_autosuspend_ms = 2000
+sata_lpm = max_performance
+aspm = performance
+audio_power_save = 0
+dirty_writeback_centisecs = 500
+dirty_expire_centisecs = 3000
+laptop_mode = 0
+read_ahead_kb = 1024"
+
+put etc/pwr/profiles.d/powersave.conf "governor = powersave
+epp = power
+turbo = off
+max_perf_pct = 50
+wifi = on
+pci_pm = auto
+usb_pm = auto
+usb_autosuspend_ms = 1000
+sata_lpm = med_power_with_dipm
+aspm = powersupersave
+audio_power_save = 1
+dirty_writeback_centisecs = 1500
+dirty_expire_centisecs = 6000
+laptop_mode = 5
+read_ahead_kb = 128"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# pwr: Power-saving-mode controller for linux laptops.
+# Copyright 2018 Ethan McTague.
+# Licensed under the MIT license. See LICENSE for full license text.
+# https://github.com/emctague/pwr
+#
+# Run pwr bench against fake systems from 4 to 256 CPUs, each with twice as many devices.
+#
+# usage: run.sh PWR [CYCLES]
+
+set -e
+
+pwr=$1
+cycles=${2:-50}
+dir=${TMPDIR:-/tmp}/pwr-bench.$$
+
+[ -x "$pwr" ] || { echo "usage: $0 PWR [CYCLES]" >&2; exit 2; }
+trap 'rm -rf "$dir"' EXIT
+
+for cpus in 4 16 64 256; do
+    devices=$((cpus * 2))
+    echo "== $cpus CPUs, $devices devices"
+    sh "$(dirname "$0")/mktree.sh" "$dir" $cpus $devices
+    "$pwr" bench --root "$dir" --cycles $cycles
+    echo
+done
@@ -0,0 +1,258 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Batteries: charge thresholds, the firmware's platform profile, and how fast charge is going.
+//
+// The knobs are found once, like storage.c's. Readings go into a ring of samples, so pwrd can
+// work out the discharge rate over the last half hour rather than trusting the instantaneous
+// power_now, which jumps around with every burst of load.
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "pwr.h"
+
+#define BATTERY_SAMPLES 64
+#define BATTERY_WINDOW_S 1800  // How far back the discharge rate looks.
+#define BATTERY_MIN_SPAN_S 120 // How much of that there has to be before it counts.
+
+static struct sysfs_group files[K_COUNT];
+static char profiles[SYSFS_VALUE_MAX];  // What platform_profile_choices offers.
+static int enumerated = 0;
+
+static struct battery_reading ring[BATTERY_SAMPLES];
+static int first = 0, samples = 0;
+
+static void enumerate ();
+static int find (char* dir, size_t len);  // The first battery's directory. Returns 0 or -1.
+static double attr (const char* dir, const char* name);  // A numeric attribute, or -1.
+static int offers (const char* available, const char* choice);
+
+
+struct sysfs_group* battery_files (int knob) {
+    if (!enumerated) enumerate();
+    return files[knob].count ? &files[knob] : NULL;
+}
+
+int battery_apply (int knob, const char* value, int force) {
+    struct sysfs_group* g = battery_files(knob);
+    if (g == NULL) return -1;
+    if (knob == K_PLATFORM_PROFILE && profiles[0] && !offers(profiles, value)) return -2;
+
+    sysfs_group_write(g, value, PWR_MAX_THREADS, force);
+
+    int changed = 0;
+    for (int i = 0; i < g->count; i++)
+        changed += g->changed[i] && !g->errors[i];
+
+    return changed;
+}
+
+const char* battery_profiles () {
+    if (!enumerated) enumerate();
+    return profiles;
+}
+
+int battery_end_first (const char* start) {
+    char value[SYSFS_VALUE_MAX];
+    struct sysfs_group* g = battery_files(K_CHARGE_END);
+
+    // Firmware refuses a start at or above the end in effect, so raising both has to go end
+    // first, and lowering both start first.
+    if (g == NULL || sysfs_read(g->paths[0], value, sizeof(value)) < 0) return 0;
+    return atoi(start) >= atoi(value);
+}
+
+int battery_read (struct battery_reading* r) {
+    char dir[512], path[600];
+
+    memset(r, 0, sizeof(*r));
+    if (find(dir, sizeof(dir)) < 0) return -1;
+
+    snprintf(path, sizeof(path), "%s/status", dir);
+    if (sysfs_read(path, r->status, sizeof(r->status)) < 0) snprintf(r->status, sizeof(r->status), "Unknown");
+
+    clock_gettime(CLOCK_MONOTONIC, &r->at);
+    r->capacity = attr(dir, "capacity");
+
+    // Batteries report either energy in uWh or charge in uAh; charge needs the voltage to
+    // become energy.
+    double volts = attr(dir, "voltage_now") / 1e6;
+    r->energy_wh = attr(dir, "energy_now") / 1e6;
+    r->full_wh = attr(dir, "energy_full") / 1e6;
+    if (r->energy_wh < 0 && volts > 0) {
+        double design = attr(dir, "voltage_min_design") / 1e6;
+        if (design > 0) volts = design;
+
+        r->energy_wh = attr(dir, "charge_now") / 1e6 * volts;
+        r->full_wh = attr(dir, "charge_full") / 1e6 * volts;
+    }
+
+    r->watts = attr(dir, "power_now") / 1e6;
+    if (r->watts < 0) {
+        double amps = attr(dir, "current_now") / 1e6;
+        r->watts = amps >= 0 && volts > 0 ? amps * volts : -1;
+    }
+
+    if (r->energy_wh < 0) r->energy_wh = -1;
+    if (r->full_wh < 0) r->full_wh = -1;
+    if (r->capacity < 0 && r->energy_wh > 0 && r->full_wh > 0) r->capacity = 100 * r->energy_wh / r->full_wh;
+    return 0;
+}
+
+int battery_capacity () {
+    struct battery_reading r;
+    return battery_read(&r) == 0 && r.capacity >= 0 ? (int)r.capacity : -1;
+}
+
+void battery_sample () {
+    struct battery_reading r;
+    if (battery_read(&r) < 0) return;
+
+    // A rate across plugging in or out would mean nothing.
+    const struct battery_reading* last = samples ? &ring[(first + samples - 1) % BATTERY_SAMPLES] : NULL;
+    if (last != NULL && strcmp(last->status, r.status)) first = samples = 0;
+
+    if (samples == BATTERY_SAMPLES) {
+        first = (first + 1) % BATTERY_SAMPLES;
+        samples--;
+    }
+
+    ring[(first + samples++) % BATTERY_SAMPLES] = r;
+}
+
+double battery_rate (double* span) {
+    *span = 0;
+    if (samples < 2) return 0;
+
+    const struct battery_reading* last = &ring[(first + samples - 1) % BATTERY_SAMPLES];
+    const struct battery_reading* oldest = NULL;
+
+    for (int i = samples - 2; i >= 0; i--) {
+        const struct battery_reading* r = &ring[(first + i) % BATTERY_SAMPLES];
+        if (last->at.tv_sec - r->at.tv_sec > BATTERY_WINDOW_S) break;
+        if (r->energy_wh >= 0) oldest = r;
+    }
+
+    if (oldest == NULL || last->energy_wh < 0) return 0;
+
+    *span = (last->at.tv_sec - oldest->at.tv_sec) + (last->at.tv_nsec - oldest->at.tv_nsec) / 1e9;
+    if (*span < BATTERY_MIN_SPAN_S) {
+        *span = 0;
+        return 0;
+    }
+
+    // Positive while discharging, negative while charging.
+    return (oldest->energy_wh - last->energy_wh) * 3600 / *span;
+}
+
+void battery_report (FILE* f) {
+    double span, watts;
+
+    // Reading it now also notices being plugged in or out since the last sample.
+    battery_sample();
+    if (samples == 0) {
+        fputs("No battery found.\n", f);
+        return;
+    }
+
+    struct battery_reading r = ring[(first + samples - 1) % BATTERY_SAMPLES];
+
+    fprintf(f, "Battery: %s", r.status);
+    if (r.capacity >= 0) fprintf(f, ", %.0f%%", r.capacity);
+    if (r.energy_wh >= 0 && r.full_wh > 0) fprintf(f, " (%.1f of %.1f Wh)", r.energy_wh, r.full_wh);
+    fputc('\n', f);
+
+    int charging = !strcmp(r.status, "Charging");
+    int discharging = !strcmp(r.status, "Discharging");
+    if (!charging && !discharging) return;
+
+    // pwrd's samples if there are enough of them, otherwise what the battery says right now.
+    watts = battery_rate(&span);
+    if (charging) watts = -watts;
+
+    if (span > 0 && watts > 0) {
+        fprintf(f, "%s rate: %.2f W over the last %.0f minutes\n", charging ? "Charge" : "Discharge", watts, span / 60);
+    } else if (r.watts > 0) {
+        watts = r.watts;
+        fprintf(f, "%s rate: %.2f W right now\n", charging ? "Charge" : "Discharge", watts);
+    } else {
+        return;
+    }
+
+    double wh = charging ? r.full_wh - r.energy_wh : r.energy_wh;
+    if (wh < 0 || r.energy_wh < 0) return;
+
+    long minutes = (long)(wh / watts * 60 + 0.5);
+    fprintf(f, "Time to %s: %ld:%02ld\n", charging ? "full" : "empty", minutes / 60, minutes % 60);
+}
+
+
+static void enumerate () {
+    glob_t results = { 0 };
+    char path[600], value[SYSFS_VALUE_MAX];
+
+    enumerated = 1;
+
+    // Laptops with two batteries have thresholds on each.
+    if (sysfs_glob("/sys/class/power_supply/*", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc; i++) {
+            snprintf(path, sizeof(path), "%s/type", results.gl_pathv[i]);
+            if (sysfs_read(path, value, sizeof(value)) < 0 || strcmp(value, "Battery")) continue;
+
+            snprintf(path, sizeof(path), "%s/charge_control_start_threshold", results.gl_pathv[i]);
+            if (sysfs_read(path, value, sizeof(value)) == 0) sysfs_group_add(&files[K_CHARGE_START], path);
+            snprintf(path, sizeof(path), "%s/charge_control_end_threshold", results.gl_pathv[i]);
+            if (sysfs_read(path, value, sizeof(value)) == 0) sysfs_group_add(&files[K_CHARGE_END], path);
+        }
+    }
+
+    globfree(&results);
+
+    if (sysfs_read("/sys/firmware/acpi/platform_profile", value, sizeof(value)) == 0) {
+        sysfs_group_add(&files[K_PLATFORM_PROFILE], "/sys/firmware/acpi/platform_profile");
+        if (sysfs_read("/sys/firmware/acpi/platform_profile_choices", profiles, sizeof(profiles)) < 0)
+            profiles[0] = 0;
+    }
+}
+
+static int find (char* dir, size_t len) {
+    glob_t results = { 0 };
+    char path[600], value[32];
+    int found = -1;
+
+    // The one energy.c reads too: the first battery.
+    if (sysfs_glob("/sys/class/power_supply/*", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc && found < 0; i++) {
+            snprintf(path, sizeof(path), "%s/type", results.gl_pathv[i]);
+            if (sysfs_read(path, value, sizeof(value)) < 0 || strcmp(value, "Battery")) continue;
+
+            snprintf(dir, len, "%s", results.gl_pathv[i]);
+            found = 0;
+        }
+    }
+
+    globfree(&results);
+    return found;
+}
+
+static double attr (const char* dir, const char* name) {
+    char path[600], value[32];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return sysfs_read(path, value, sizeof(value)) == 0 ? atof(value) : -1;
+}
+
+static int offers (const char* available, const char* choice) {
+    size_t len = strlen(choice);
+
+    for (const char* p = available; (p = strstr(p, choice)) != NULL; p += len)
+        if ((p == available || p[-1] == ' ') && (p[len] == ' ' || p[len] == 0)) return 1;
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// What the hardware and system offer, remembered across runs in /run/pwr/caps.
+//
+// Each discovery step stores what it found under a key, so the next run can skip it. The file
+// is text, one "key value" pair per line after a header holding the boot ID and the mtime of
+// /etc/pwr; either one changing, or the file being removed on hotplug, starts it over. Lists
+// of paths are space-separated, which sysfs paths never contain.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+#define CAPS_VERSION 1
+#define MAX_CAPS 128
+
+static struct {
+    char* key;
+    char* value;
+} caps[MAX_CAPS];
+
+static int count = 0;
+static int loaded = 0;
+static int dirty = 0;
+
+// Backends discover things from their own threads during a switch.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load ();
+static int header (char* out, size_t len);  // The header the file must start with to be valid.
+static void set (const char* key, const char* value);
+
+
+int caps_get (const char* key, char* out, size_t len) {
+    int found = 0;
+
+    // Copied under the lock: another thread's caps_set() frees the value it replaces.
+    pthread_mutex_lock(&lock);
+    if (!loaded) load();
+
+    for (int i = 0; i < count && !found; i++)
+        if (!strcmp(caps[i].key, key)) found = (size_t)snprintf(out, len, "%s", caps[i].value) < len;
+
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+void caps_set (const char* key, const char* value) {
+    pthread_mutex_lock(&lock);
+    if (!loaded) load();
+    set(key, value);
+    pthread_mutex_unlock(&lock);
+}
+
+int caps_get_group (const char* key, struct sysfs_group* g) {
+    char list[CAPS_VALUE_MAX], path[512];
+
+    if (!caps_get(key, list, sizeof(list))) return 0;
+
+    memset(g, 0, sizeof(*g));
+    for (const char* p = list; *p; ) {
+        size_t len = strcspn(p, " ");
+        if (len > 0 && len < sizeof(path)) {
+            memcpy(path, p, len);
+            path[len] = 0;
+            sysfs_group_add(g, path);
+        }
+
+        p += len;
+        if (*p) p++;
+    }
+
+    return 1;
+}
+
+void caps_set_group (const char* key, const struct sysfs_group* g) {
+    size_t len = 1;
+    for (int i = 0; i < g->count; i++)
+        len += strlen(g->paths[i]) + 1;
+
+    char* list = calloc(1, len);
+    for (int i = 0; i < g->count; i++) {
+        if (i) strcat(list, " ");
+        strcat(list, g->paths[i]);
+    }
+
+    caps_set(key, list);
+    free(list);
+}
+
+void caps_save () {
+    char line[128], tmp[PATH_MAX], dir[PATH_MAX], buf[PATH_MAX];
+
+    pthread_mutex_lock(&lock);
+    if (!dirty || header(line, sizeof(line)) < 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    // Only root can write it, like the profile cache; everyone else just discovers each time.
+    mkdir(sysfs_path(PWR_CAPS_DIR, dir, sizeof(dir)), 0755);
+    const char* file = sysfs_path(PWR_CAPS, buf, sizeof(buf));
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    FILE* f = fopen(tmp, "w");
+
+    if (f != NULL) {
+        int ok = fputs(line, f) >= 0;
+        for (int i = 0; i < count && ok; i++)
+            ok = fprintf(f, "%s %s\n", caps[i].key, caps[i].value) > 0;
+
+        if (fclose(f) != 0 || !ok || rename(tmp, file) < 0) unlink(tmp);
+        else dirty = 0;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+void caps_invalidate () {
+    char file[PATH_MAX];
+    pthread_mutex_lock(&lock);
+
+    for (int i = 0; i < count; i++) {
+        free(caps[i].key);
+        free(caps[i].value);
+    }
+
+    count = 0;
+    loaded = 1;
+    dirty = 0;
+    unlink(sysfs_path(PWR_CAPS, file, sizeof(file)));
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void load () {
+    char expected[128];
+    char* line = NULL;
+    size_t len = 0;
+
+    loaded = 1;
+    if (header(expected, sizeof(expected)) < 0) return;
+
+    FILE* f = sysfs_fopen(PWR_CAPS, "r");
+    if (f == NULL) return;
+
+    // Path lists on big machines run to a few kilobytes, hence getline().
+    if (getline(&line, &len, f) > 0 && !strcmp(line, expected)) {
+        while (getline(&line, &len, f) > 0) {
+            line[strcspn(line, "\n")] = 0;
+            char* value = strchr(line, ' ');
+            if (value == NULL) continue;
+
+            *value++ = 0;
+            set(line, value);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    dirty = 0;
+}
+
+static int header (char* out, size_t len) {
+    char boot_id[64];
+    struct stat st = { 0 };
+
+    if (sysfs_read("/proc/sys/kernel/random/boot_id", boot_id, sizeof(boot_id)) < 0) return -1;
+    sysfs_stat(PWR_CONFIG_DIR, &st);
+
+    snprintf(out, len, "pwr-caps %d %s %ld.%09ld\n", CAPS_VERSION, boot_id,
+             (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    return 0;
+}
+
+static void set (const char* key, const char* value) {
+    int i;
+    for (i = 0; i < count && strcmp(caps[i].key, key); i++);
+
+    if (i < count) {
+        if (!strcmp(caps[i].value, value)) return;
+        free(caps[i].value);
+    } else if (count < MAX_CAPS) {
+        caps[count++].key = strdup(key);
+    } else {
+        return;
+    }
+
+    caps[i].value = strdup(value);
+    dirty = 1;
+}
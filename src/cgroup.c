@@ -0,0 +1,95 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// CPU limits on cgroup v2 slices, written straight to cgroupfs.
+//
+// A slice is a path under /sys/fs/cgroup, and may be a glob pattern so that it covers e.g. every
+// user's background.slice. Each slice/attribute pair gets its own group, kept open once found.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glob.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define MAX_SLICES 16
+
+static const char* attrs[CG_COUNT] = {
+    [CG_CPU_MAX] = "cpu.max",
+    [CG_CPU_WEIGHT] = "cpu.weight",
+    [CG_CPUSET] = "cpuset.cpus",
+    [CG_UCLAMP_MAX] = "cpu.uclamp.max"
+};
+
+// The controller that has to be enabled in the parent for each attribute to exist. Which
+// controllers a slice gets is systemd's to decide (CPUAccounting=, Delegate=), so pwr only uses
+// those it has been given and never rewrites cgroup.subtree_control itself.
+static const char* controllers[CG_COUNT] = {
+    [CG_CPU_MAX] = "cpu",
+    [CG_CPU_WEIGHT] = "cpu",
+    [CG_CPUSET] = "cpuset",
+    [CG_UCLAMP_MAX] = "cpu"
+};
+
+static struct {
+    char slice[PROFILE_VALUE_MAX];
+    int attr;
+    struct sysfs_group group;
+} slices[MAX_SLICES];
+
+static int slice_count = 0;
+
+static void find (const char* slice, int attr, struct sysfs_group* g);
+
+
+struct sysfs_group* cgroup_files (const char* slice, int attr) {
+    // Relative to the cgroup root, and no climbing out of it.
+    if (slice[0] == '/' || strstr(slice, "..") != NULL) return NULL;
+
+    for (int i = 0; i < slice_count; i++) {
+        if (slices[i].attr == attr && !strcmp(slices[i].slice, slice))
+            return slices[i].group.count ? &slices[i].group : NULL;
+    }
+
+    if (slice_count == MAX_SLICES) return NULL;
+
+    int i = slice_count++;
+    snprintf(slices[i].slice, sizeof(slices[i].slice), "%s", slice);
+    slices[i].attr = attr;
+    find(slice, attr, &slices[i].group);
+    return slices[i].group.count ? &slices[i].group : NULL;
+}
+
+const char* cgroup_attr_name (int attr) {
+    return attrs[attr];
+}
+
+const char* cgroup_controller (int attr) {
+    return controllers[attr];
+}
+
+
+static void find (const char* slice, int attr, struct sysfs_group* g) {
+    glob_t results = { 0 };
+    char path[512];
+    struct stat st;
+
+    snprintf(path, sizeof(path), CGROUP_ROOT "/%s", slice);
+    if (sysfs_glob(path, GLOB_ONLYDIR, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc; i++) {
+            snprintf(path, sizeof(path), "%s/%s", results.gl_pathv[i], attrs[attr]);
+
+            // The attribute only shows up once the parent hands the controller down.
+            if (sysfs_stat(path, &st) == 0) sysfs_group_add(g, path);
+        }
+    }
+
+    globfree(&results);
+}
@@ -0,0 +1,292 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// CPU frequency control that knows which scaling driver is in charge.
+//
+// intel_pstate and amd_pstate (in active mode) pick frequencies themselves and mostly listen to
+// energy_performance_preference; acpi-cpufreq and friends only have the governor and frequency
+// limits. Each knob maps to whichever files the running driver provides, found on first use.
+//
+// On hybrid parts the performance and efficiency cores can also be taken offline or capped
+// separately. Core types come from the cpu_core and cpu_atom PMUs, or failing that from
+// cpu_capacity, where the biggest cores count as performance cores.
+//
+// What each knob maps to, and the core types, are kept in the capability cache.
+
+#include <pthread.h>
+#include <glob.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+#define CPUFREQ "/sys/devices/system/cpu/cpufreq"
+#define CPU0 "/sys/devices/system/cpu/cpu0/cpufreq"
+#define CPU_MAX 1024
+
+enum core_type { CORE_UNKNOWN, CORE_P, CORE_E };
+
+// Every CPU knob, for cpu_discover().
+static const int cpu_knobs[] = {
+    K_GOVERNOR, K_EPP, K_TURBO, K_MIN_PERF, K_MAX_PERF, K_MIN_FREQ, K_MAX_FREQ,
+    K_PCORES, K_ECORES, K_PCORE_MAX_FREQ, K_ECORE_MAX_FREQ
+};
+
+static struct sysfs_group files[K_COUNT];
+static int probed[K_COUNT];
+static int turbo_inverted = 0;  // intel_pstate has no_turbo rather than boost.
+
+static unsigned char core_types[CPU_MAX];  // enum core_type of each CPU, by number.
+static int hybrid = -1;                    // Whether there are two core types, once known.
+static pthread_mutex_t hybrid_lock = PTHREAD_MUTEX_INITIALIZER;  // The cpu and cgroup steps both ask.
+
+static void probe (int knob);   // Find the files behind a knob, if the driver has any.
+static int glob_first (struct sysfs_group* g, const char* a, const char* b);
+static int probe_hybrid ();     // Sort CPUs into core types. Returns true on a hybrid CPU.
+static int find_core_types ();  // The same, without the cache.
+static int read_cpulist (const char* path, enum core_type type);
+static void add_cores (struct sysfs_group* g, enum core_type type, const char* attr);
+
+
+const char* cpu_driver () {
+    static char driver[32];
+
+    if (driver[0]) return driver;
+
+    if (caps_get("cpu.driver", driver, sizeof(driver))) return driver;
+
+    if (sysfs_read(CPUFREQ "/policy0/scaling_driver", driver, sizeof(driver)) < 0 &&
+        sysfs_read(CPU0 "/scaling_driver", driver, sizeof(driver)) < 0)
+        driver[0] = 0;
+
+    caps_set("cpu.driver", driver);
+    return driver;
+}
+
+struct sysfs_group* cpu_files (int knob) {
+    if (!probed[knob]) probe(knob);
+    return files[knob].count ? &files[knob] : NULL;
+}
+
+const char* cpu_value (int knob, const char* value) {
+    int on = !strcmp(value, "on");
+    if (knob == K_PCORES || knob == K_ECORES) return on ? "1" : "0";
+    if (knob != K_TURBO) return value;
+
+    if (turbo_inverted) return on ? "0" : "1";
+    return on ? "1" : "0";
+}
+
+int cpu_max_first (int min_knob, const char* min) {
+    char current[32];
+
+    // Raising the minimum past the current maximum would be rejected, so lift the maximum first.
+    struct sysfs_group* max = cpu_files(min_knob + 1);
+    if (max == NULL || sysfs_read(max->paths[0], current, sizeof(current)) < 0) return 0;
+    return atol(min) > atol(current);
+}
+
+int cpu_core_list (int performance, char* out, size_t len) {
+    enum core_type type = performance ? CORE_P : CORE_E;
+    size_t used = 0;
+
+    if (!probe_hybrid()) return -1;
+    out[0] = 0;
+
+    // Back to the kernel's list format, e.g. "12-19".
+    for (int cpu = 0; cpu < CPU_MAX; cpu++) {
+        if (core_types[cpu] != type) continue;
+
+        int last = cpu;
+        while (last + 1 < CPU_MAX && core_types[last + 1] == type) last++;
+
+        used += snprintf(out + used, used < len ? len - used : 0, used ? ",%d" : "%d", cpu);
+        if (last > cpu) used += snprintf(out + used, used < len ? len - used : 0, "-%d", last);
+        cpu = last;
+    }
+
+    return used < len && used > 0 ? 0 : -1;
+}
+
+void cpu_discover () {
+    for (size_t i = 0; i < sizeof(cpu_knobs) / sizeof(cpu_knobs[0]); i++)
+        cpu_files(cpu_knobs[i]);
+}
+
+
+static void probe (int knob) {
+    struct sysfs_group* g = &files[knob];
+    char key[48];
+
+    probed[knob] = 1;
+    snprintf(key, sizeof(key), "cpu.%s", knob_name(knob));
+
+    if (caps_get_group(key, g)) {
+        char inverted[8];
+        if (knob == K_TURBO)
+            turbo_inverted = caps_get("cpu.turbo_inverted", inverted, sizeof(inverted)) && inverted[0] == '1';
+        return;
+    }
+
+    // CPUs sharing a cpufreq policy share its settings, so one write per policy is enough.
+    switch (knob) {
+    case K_GOVERNOR:
+        glob_first(g, CPUFREQ "/policy*/scaling_governor", "/sys/devices/system/cpu/cpu*/cpufreq/scaling_governor");
+        break;
+
+    case K_EPP:
+        glob_first(g, CPUFREQ "/policy*/energy_performance_preference", NULL);
+        break;
+
+    // intel_pstate-wide limits, as a percentage of the maximum frequency.
+    case K_MIN_PERF:
+        glob_first(g, "/sys/devices/system/cpu/intel_pstate/min_perf_pct", NULL);
+        break;
+
+    case K_MAX_PERF:
+        glob_first(g, "/sys/devices/system/cpu/intel_pstate/max_perf_pct", NULL);
+        break;
+
+    // In kHz. The kernel clamps these to what the hardware supports.
+    case K_MIN_FREQ:
+        glob_first(g, CPUFREQ "/policy*/scaling_min_freq", NULL);
+        break;
+
+    case K_MAX_FREQ:
+        glob_first(g, CPUFREQ "/policy*/scaling_max_freq", NULL);
+        break;
+
+    // intel_pstate replaces the global boost switch with no_turbo; amd_pstate has it per policy.
+    case K_TURBO:
+        turbo_inverted = glob_first(g, "/sys/devices/system/cpu/intel_pstate/no_turbo", NULL) > 0;
+        if (!turbo_inverted) glob_first(g, CPUFREQ "/boost", CPUFREQ "/policy*/boost");
+        break;
+
+    // Hotplugging goes through each CPU; the cpufreq policies of hybrid parts are per-CPU anyway.
+    case K_PCORES:
+    case K_ECORES:
+        if (probe_hybrid()) add_cores(g, knob == K_PCORES ? CORE_P : CORE_E, "online");
+        break;
+
+    case K_PCORE_MAX_FREQ:
+    case K_ECORE_MAX_FREQ:
+        if (probe_hybrid()) add_cores(g, knob == K_PCORE_MAX_FREQ ? CORE_P : CORE_E, "cpufreq/scaling_max_freq");
+        break;
+    }
+
+    if (knob == K_TURBO) caps_set("cpu.turbo_inverted", turbo_inverted ? "1" : "0");
+    caps_set_group(key, g);
+}
+
+static int glob_first (struct sysfs_group* g, const char* a, const char* b) {
+    int count = sysfs_group_glob(g, a);
+    if (count == 0 && b != NULL) count = sysfs_group_glob(g, b);
+    return count;
+}
+
+static int probe_hybrid () {
+    static const char letters[] = { [CORE_UNKNOWN] = '-', [CORE_P] = 'P', [CORE_E] = 'E' };
+    char known[CPU_MAX + 1];
+
+    pthread_mutex_lock(&hybrid_lock);
+    if (hybrid >= 0) {
+        pthread_mutex_unlock(&hybrid_lock);
+        return hybrid;
+    }
+
+    // One letter per CPU, e.g. "PPPPEEEE", or "" if they're all the same.
+    char cached[CAPS_VALUE_MAX];
+    if (caps_get("cpu.cores", cached, sizeof(cached))) {
+        for (int cpu = 0; cached[cpu] && cpu < CPU_MAX; cpu++)
+            core_types[cpu] = cached[cpu] == 'P' ? CORE_P : cached[cpu] == 'E' ? CORE_E : CORE_UNKNOWN;
+        hybrid = cached[0] != 0;
+        pthread_mutex_unlock(&hybrid_lock);
+        return hybrid;
+    }
+
+    int found = find_core_types();
+
+    int last = -1;
+    for (int cpu = 0; cpu < CPU_MAX && found; cpu++) {
+        known[cpu] = letters[core_types[cpu]];
+        if (core_types[cpu] != CORE_UNKNOWN) last = cpu;
+    }
+
+    known[last + 1] = 0;
+    caps_set("cpu.cores", known);
+
+    hybrid = found;
+    pthread_mutex_unlock(&hybrid_lock);
+    return found;
+}
+
+static int find_core_types () {
+    // Intel registers a PMU per core type, each listing its CPUs.
+    if (read_cpulist("/sys/devices/cpu_core/cpus", CORE_P) > 0 &&
+        read_cpulist("/sys/devices/cpu_atom/cpus", CORE_E) > 0)
+        return 1;
+
+    memset(core_types, CORE_UNKNOWN, sizeof(core_types));
+
+    // Elsewhere, cores only differ in their relative capacity (1024 for the biggest).
+    glob_t results = { 0 };
+    long capacity[CPU_MAX] = { 0 }, biggest = 0, smallest = 0;
+    int types = 0;
+
+    if (sysfs_glob("/sys/devices/system/cpu/cpu[0-9]*/cpu_capacity", 0, NULL, &results) == 0) {
+        char value[16];
+
+        for (size_t i = 0; i < results.gl_pathc; i++) {
+            int cpu = atoi(results.gl_pathv[i] + strlen("/sys/devices/system/cpu/cpu"));
+            if (cpu >= CPU_MAX || sysfs_read(results.gl_pathv[i], value, sizeof(value)) < 0) continue;
+
+            capacity[cpu] = atol(value);
+            if (capacity[cpu] > biggest) biggest = capacity[cpu];
+            if (capacity[cpu] > 0 && (smallest == 0 || capacity[cpu] < smallest)) smallest = capacity[cpu];
+        }
+    }
+
+    globfree(&results);
+
+    for (int cpu = 0; cpu < CPU_MAX && biggest > smallest; cpu++) {
+        if (capacity[cpu] == 0) continue;
+        core_types[cpu] = capacity[cpu] == biggest ? CORE_P : CORE_E;
+        types++;
+    }
+
+    return types > 0;
+}
+
+static int read_cpulist (const char* path, enum core_type type) {
+    char list[256];
+    int count = 0;
+
+    if (sysfs_read(path, list, sizeof(list)) < 0) return 0;
+
+    // e.g. "0-11,16,18-19"
+    char* save;
+    for (char* range = strtok_r(list, ",", &save); range != NULL; range = strtok_r(NULL, ",", &save)) {
+        char* dash = strchr(range, '-');
+        int first = atoi(range), last = dash ? atoi(dash + 1) : first;
+
+        for (int cpu = first; cpu <= last && cpu < CPU_MAX; cpu++, count++)
+            core_types[cpu] = type;
+    }
+
+    return count;
+}
+
+static void add_cores (struct sysfs_group* g, enum core_type type, const char* attr) {
+    char path[128];
+
+    // The boot CPU can't go offline.
+    for (int cpu = !strcmp(attr, "online"); cpu < CPU_MAX; cpu++) {
+        if (core_types[cpu] != type) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, attr);
+        sysfs_group_add(g, path);
+    }
+}
@@ -0,0 +1,326 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+#define _GNU_SOURCE  // accept4()
+
+// The pwrd control socket: a daemon that serves requests, and the client that sends them.
+// Other event sources (uevents, timers) can be watched on the same loop.
+//
+// Clients are read without blocking on the same loop too, so one that connects and sends
+// nothing can't hold up uevents or anyone else; it's dropped after CLIENT_TIMEOUT_MS.
+//
+// A request is the client's argument list, each argument nul-terminated, followed by an empty
+// argument. The reply is everything the request printed, then a nul byte and the exit status.
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pwr.h"
+
+#define REQ_MAX 4096
+#define REQ_MAX_ARGS 32
+#define MAX_WATCHES 16
+#define MAX_CLIENTS 16
+#define CLIENT_TIMEOUT_MS 1000
+
+// epoll tags: the control socket, then clients by slot; watches are tagged with their index.
+#define TAG_LISTEN ((uint32_t)-1)
+#define TAG_CLIENT 0x10000
+
+// An fd other than the control socket that the daemon reacts to.
+struct watch {
+    int fd;
+    daemon_callback ready;
+};
+
+// A client whose request is still coming in.
+struct client {
+    int fd;
+    size_t len;
+    struct timespec since;
+    char req[REQ_MAX];
+};
+
+static struct watch watches[MAX_WATCHES];
+static int watch_count = 0;
+static struct client clients[MAX_CLIENTS];
+
+static int listen_socket (const char* path);              // Use systemd's socket, or bind our own.
+static int client_accept (int fd, int epfd);              // Take a new client. Returns -1 if fd failed.
+static int client_read (struct client* c);                // 1 once the request is in, 0 for more, -1 to drop.
+static void client_drop (struct client* c, int epfd);
+static int clients_expire (int epfd);                     // Drop stalled clients. Returns ms to the next, or -1.
+static long ms_between (const struct timespec* a, const struct timespec* b);
+static void serve_one (int client, char* req, size_t len, daemon_handler handle); // Run and reply to one request.
+static int send_all (int fd, const void* data, size_t len);
+
+
+int daemon_watch (int fd, daemon_callback ready) {
+    if (watch_count == MAX_WATCHES) return -1;
+    watches[watch_count++] = (struct watch){ fd, ready };
+    return 0;
+}
+
+int daemon_serve (const char* path, daemon_handler handle) {
+    int fd = path ? listen_socket(path) : -1;
+    if (path && fd < 0) return -1;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) return -1;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = TAG_LISTEN };
+    if (fd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    for (int i = 0; i < watch_count; i++) {
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, watches[i].fd, &ev);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    // Everything runs on this one thread, so switches can never overlap.
+    for (;;) {
+        int n = epoll_wait(epfd, &ev, 1, clients_expire(epfd));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) continue;
+
+        if (ev.data.u32 == TAG_LISTEN) {
+            if (client_accept(fd, epfd) < 0) return -1;
+            continue;
+        }
+
+        if (ev.data.u32 < TAG_CLIENT) {
+            struct watch* w = &watches[ev.data.u32];
+            w->ready(w->fd);
+            continue;
+        }
+
+        struct client* c = &clients[ev.data.u32 - TAG_CLIENT];
+        int done = client_read(c);
+        if (done < 0) client_drop(c, epfd);
+        if (done <= 0) continue;
+
+        // The reply is written blocking, but a client that stops reading still only costs a second.
+        struct timeval tv = { .tv_sec = CLIENT_TIMEOUT_MS / 1000 };
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        serve_one(c->fd, c->req, c->len, handle);
+        close(c->fd);
+        c->fd = -1;
+
+        // The time that took doesn't count against the clients still waiting.
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0) clock_gettime(CLOCK_MONOTONIC, &clients[i].since);
+    }
+}
+
+int daemon_request (const char* path, int argc, char** argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char req[REQ_MAX];
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        if (n == 1 || len + n + 1 > sizeof(req)) continue;
+        memcpy(req + len, argv[i], n);
+        len += n;
+    }
+    req[len++] = 0;
+
+    if (send_all(fd, req, len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Copy output through until the nul that precedes the status byte.
+    char buf[REQ_MAX];
+    int status = -1, ended = 0;
+    ssize_t got;
+    while (!ended && (got = read(fd, buf, sizeof(buf))) > 0) {
+        char* end = memchr(buf, 0, got);
+        fwrite(buf, 1, end ? end - buf : got, stdout);
+
+        if (end != NULL) {
+            ended = 1;
+            if (end + 1 < buf + got) status = (unsigned char)end[1];
+            else if (read(fd, buf, 1) == 1) status = (unsigned char)buf[0];
+        }
+    }
+
+    close(fd);
+    fflush(stdout);
+    return status;
+}
+
+
+static int listen_socket (const char* path) {
+    // Socket activation: systemd passes the listening socket as fd 3.
+    const char* fds = getenv("LISTEN_FDS");
+    const char* pid = getenv("LISTEN_PID");
+    if (fds != NULL && pid != NULL && atoi(pid) == getpid() && atoi(fds) >= 1) return 3;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // Only clear out the socket if it's stale, not if another pwrd is answering on it.
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Anyone may switch modes, just as anyone may run the setuid binary.
+    chmod(path, 0666);
+    return fd;
+}
+
+static int client_accept (int fd, int epfd) {
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client < 0) return errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ? 0 : -1;
+
+    // With every slot taken, the longest-waiting client makes room; a real one has long since
+    // sent its request.
+    struct client* c = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            c = &clients[i];
+            break;
+        }
+
+        if (c == NULL || ms_between(&clients[i].since, &c->since) > 0) c = &clients[i];
+    }
+
+    if (c->fd >= 0) client_drop(c, epfd);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = TAG_CLIENT + (c - clients) };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+        close(client);
+        return 0;
+    }
+
+    c->fd = client;
+    c->len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+    return 0;
+}
+
+static int client_read (struct client* c) {
+    for (;;) {
+        if (c->len == sizeof(c->req)) return -1;
+        ssize_t got = read(c->fd, c->req + c->len, sizeof(c->req) - c->len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && errno == EAGAIN) return 0;
+        if (got <= 0) return -1;
+        c->len += got;
+
+        // The request ends with an empty argument, i.e. two nuls in a row (or one, if it's empty).
+        if (c->req[c->len - 1] == 0 && (c->len == 1 || c->req[c->len - 2] == 0)) return 1;
+    }
+}
+
+static void client_drop (struct client* c, int epfd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static int clients_expire (int epfd) {
+    struct timespec now;
+    long next = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) continue;
+
+        long left = CLIENT_TIMEOUT_MS - ms_between(&clients[i].since, &now);
+        if (left <= 0) client_drop(&clients[i], epfd);
+        else if (next < 0 || left < next) next = left;
+    }
+
+    return next;
+}
+
+static long ms_between (const struct timespec* a, const struct timespec* b) {
+    return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+static void serve_one (int client, char* req, size_t len, daemon_handler handle) {
+    char* argv[REQ_MAX_ARGS + 1];
+    int argc = 0;
+
+    argv[argc++] = "pwr";
+    for (size_t pos = 0; pos < len && req[pos] && argc < REQ_MAX_ARGS; pos += strlen(req + pos) + 1)
+        argv[argc++] = req + pos;
+    argv[argc] = NULL;
+
+    // Whatever the request prints goes straight back to the client.
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    dup2(client, STDOUT_FILENO);
+    dup2(client, STDERR_FILENO);
+
+    int status = handle(argc, argv);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    char trailer[2] = { 0, (char)status };
+    send_all(client, trailer, sizeof(trailer));
+}
+
+static int send_all (int fd, const void* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data = (const char*)data + n;
+        len -= n;
+    }
+
+    return 0;
+}
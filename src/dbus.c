@@ -0,0 +1,389 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+#define _GNU_SOURCE  // secure_getenv()
+
+// Just enough of the D-Bus wire protocol to call into systemd over the system bus.
+// Only little-endian messages with string/object-path/uint32 values are supported.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pwr.h"
+
+#define DBUS_SOCKET "/run/dbus/system_bus_socket"
+#define DBUS_TIMEOUT 25  // Seconds for a whole restart, the libdbus default for one call.
+#define DBUS_MAX_MSG 4096
+
+// Message types.
+enum {
+    DBUS_METHOD_CALL = 1,
+    DBUS_METHOD_RETURN = 2,
+    DBUS_ERROR = 3,
+    DBUS_SIGNAL = 4
+};
+
+// Header field codes.
+enum {
+    DBUS_FIELD_PATH = 1,
+    DBUS_FIELD_INTERFACE = 2,
+    DBUS_FIELD_MEMBER = 3,
+    DBUS_FIELD_ERROR_NAME = 4,
+    DBUS_FIELD_REPLY_SERIAL = 5,
+    DBUS_FIELD_DESTINATION = 6,
+    DBUS_FIELD_SIGNATURE = 8
+};
+
+// A message being built or parsed.
+struct dbus_msg {
+    unsigned char data[DBUS_MAX_MSG];
+    size_t len;
+};
+
+// Fields picked out of a received message header.
+struct dbus_header {
+    int type;
+    uint32_t reply_serial;
+    const char* member;
+    const char* error_name;
+    const unsigned char* body;
+    size_t body_len;
+};
+
+static uint32_t serial = 0;
+static struct timespec deadline;  // When the current dbus_restart_unit() gives up.
+
+static int dbus_connect ();                    // Connect and authenticate to the system bus.
+static uint32_t dbus_call (int fd, const char* dest, const char* path, const char* iface,
+                           const char* member, const char* sig, const char* arg1, const char* arg2);
+static int dbus_read (int fd, struct dbus_msg* msg, struct dbus_header* hdr); // Receive one message.
+static int dbus_readable (int fd);             // Wait for data until the deadline. Returns 1 if there is some.
+static int dbus_wait_reply (int fd, uint32_t expect, struct dbus_msg* msg, struct dbus_header* hdr);
+
+static void put_align (struct dbus_msg* m, size_t n);
+static void put_byte (struct dbus_msg* m, unsigned char b);
+static void put_u32 (struct dbus_msg* m, uint32_t v);
+static void put_string (struct dbus_msg* m, const char* s);
+static void put_signature (struct dbus_msg* m, const char* s);
+static void put_field (struct dbus_msg* m, unsigned char code, char type, const char* value);
+
+static const char* get_string (const unsigned char* data, size_t len, size_t* pos);
+
+
+int dbus_restart_unit (const char* unit, int wait) {
+    struct dbus_msg msg;
+    struct dbus_header hdr;
+    char job[256] = "";
+    int result = 1;
+
+    // Other traffic on the bus, like signals for unrelated jobs, mustn't keep us waiting forever.
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DBUS_TIMEOUT;
+
+    int fd = dbus_connect();
+    if (fd < 0) return -1;
+
+    // Subscribe before queueing the job so the JobRemoved signal can't be missed.
+    if (wait) {
+        uint32_t s = dbus_call(fd, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+            "org.freedesktop.DBus", "AddMatch", "s",
+            "type='signal',sender='org.freedesktop.systemd1',"
+            "interface='org.freedesktop.systemd1.Manager',member='JobRemoved'", NULL);
+        if (dbus_wait_reply(fd, s, &msg, &hdr) < 0) goto out;
+
+        s = dbus_call(fd, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+            "org.freedesktop.systemd1.Manager", "Subscribe", NULL, NULL, NULL);
+        if (dbus_wait_reply(fd, s, &msg, &hdr) < 0) goto out;
+    }
+
+    uint32_t s = dbus_call(fd, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+        "org.freedesktop.systemd1.Manager", "RestartUnit", "ss", unit, "replace");
+    if (dbus_wait_reply(fd, s, &msg, &hdr) < 0) goto out;
+
+    size_t pos = 0;
+    const char* path = get_string(hdr.body, hdr.body_len, &pos);
+    if (path == NULL || strlen(path) >= sizeof(job)) goto out;
+    strcpy(job, path);
+
+    // JobRemoved(u id, o job, s unit, s result)
+    while (wait) {
+        if (dbus_read(fd, &msg, &hdr) < 0) {
+            fprintf(stderr, "Restarting %s: no reply from systemd\n", unit);
+            goto out;
+        }
+
+        if (hdr.type != DBUS_SIGNAL || hdr.member == NULL || strcmp(hdr.member, "JobRemoved")) continue;
+
+        pos = 4;
+        path = get_string(hdr.body, hdr.body_len, &pos);
+        if (path == NULL || strcmp(path, job)) continue;
+
+        get_string(hdr.body, hdr.body_len, &pos);
+        const char* status = get_string(hdr.body, hdr.body_len, &pos);
+        if (status != NULL && strcmp(status, "done")) {
+            fprintf(stderr, "Restarting %s: job %s\n", unit, status);
+            goto out;
+        }
+        break;
+    }
+
+    result = 0;
+
+out:
+    close(fd);
+    return result;
+}
+
+
+static int dbus_connect () {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char* path = DBUS_SOCKET;
+
+    // Honour an explicit unix:path= address, as libdbus does, unless the caller isn't who pwr runs
+    // as: a bus of their own could then answer for systemd.
+    const char* env = secure_getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    if (env != NULL && !strncmp(env, "unix:path=", 10)) path = env + 10;
+
+    size_t plen = strcspn(path, ",;");
+    if (plen >= sizeof(addr.sun_path)) return -1;
+    memcpy(addr.sun_path, path, plen);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    struct timeval tv = { .tv_sec = DBUS_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) goto fail;
+
+    // SASL EXTERNAL: the uid is sent as a hex-encoded decimal string.
+    char uid[16], auth[64];
+    snprintf(uid, sizeof(uid), "%u", (unsigned)geteuid());
+    int n = snprintf(auth, sizeof(auth), "%cAUTH EXTERNAL ", 0);
+    for (const char* c = uid; *c; c++)
+        n += snprintf(auth + n, sizeof(auth) - n, "%02x", *c);
+    n += snprintf(auth + n, sizeof(auth) - n, "\r\n");
+
+    if (write(fd, auth, n) != n) goto fail;
+
+    char line[256];
+    ssize_t got = dbus_readable(fd) ? read(fd, line, sizeof(line) - 1) : -1;
+    if (got < 3 || strncmp(line, "OK ", 3)) goto fail;
+    if (write(fd, "BEGIN\r\n", 7) != 7) goto fail;
+
+    struct dbus_msg msg;
+    struct dbus_header hdr;
+    uint32_t s = dbus_call(fd, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+        "org.freedesktop.DBus", "Hello", NULL, NULL, NULL);
+    if (dbus_wait_reply(fd, s, &msg, &hdr) < 0) goto fail;
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static uint32_t dbus_call (int fd, const char* dest, const char* path, const char* iface,
+                           const char* member, const char* sig, const char* arg1, const char* arg2) {
+    struct dbus_msg m = { .len = 0 };
+
+    // Fixed header; body length and field array length are patched in below.
+    put_byte(&m, 'l');
+    put_byte(&m, DBUS_METHOD_CALL);
+    put_byte(&m, 0);
+    put_byte(&m, 1);
+    put_u32(&m, 0);
+    put_u32(&m, ++serial);
+    put_u32(&m, 0);
+
+    size_t fields = m.len;
+    put_field(&m, DBUS_FIELD_PATH, 'o', path);
+    put_field(&m, DBUS_FIELD_DESTINATION, 's', dest);
+    put_field(&m, DBUS_FIELD_INTERFACE, 's', iface);
+    put_field(&m, DBUS_FIELD_MEMBER, 's', member);
+    if (sig != NULL) put_field(&m, DBUS_FIELD_SIGNATURE, 'g', sig);
+
+    uint32_t flen = m.len - fields;
+    memcpy(m.data + 12, &flen, 4);
+    put_align(&m, 8);
+
+    size_t body = m.len;
+    if (arg1 != NULL) put_string(&m, arg1);
+    if (arg2 != NULL) put_string(&m, arg2);
+
+    uint32_t blen = m.len - body;
+    memcpy(m.data + 4, &blen, 4);
+
+    if (write(fd, m.data, m.len) != (ssize_t)m.len) return 0;
+    return serial;
+}
+
+static int dbus_read (int fd, struct dbus_msg* msg, struct dbus_header* hdr) {
+    uint32_t blen, flen;
+    size_t want = 16;
+
+    msg->len = 0;
+    while (msg->len < want) {
+        ssize_t got = dbus_readable(fd) ? read(fd, msg->data + msg->len, want - msg->len) : -1;
+        if (got <= 0) return -1;
+        msg->len += got;
+
+        if (want == 16 && msg->len == 16) {
+            if (msg->data[0] != 'l') return -1;
+            memcpy(&blen, msg->data + 4, 4);
+            memcpy(&flen, msg->data + 12, 4);
+            want = 16 + ((flen + 7) & ~7) + blen;
+            if (want > sizeof(msg->data)) break;
+        }
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    // Nothing we wait for is this large, so drain it and hand back an empty message.
+    if (want > sizeof(msg->data)) {
+        for (want -= 16; want > 0; ) {
+            size_t chunk = want < sizeof(msg->data) ? want : sizeof(msg->data);
+            ssize_t got = dbus_readable(fd) ? read(fd, msg->data, chunk) : -1;
+            if (got <= 0) return -1;
+            want -= got;
+        }
+        return 0;
+    }
+
+    hdr->type = msg->data[1];
+    hdr->body = msg->data + want - blen;
+    hdr->body_len = blen;
+
+    // Walk the a(yv) header field array.
+    size_t pos = 16, end = 16 + flen;
+    while (pos < end) {
+        pos = (pos + 7) & ~7;
+        if (pos + 4 > end) break;
+
+        unsigned char code = msg->data[pos];
+        char type = msg->data[pos + 2];
+        pos += 4;
+
+        if (type == 'u') {
+            pos = (pos + 3) & ~3;
+            if (code == DBUS_FIELD_REPLY_SERIAL) memcpy(&hdr->reply_serial, msg->data + pos, 4);
+            pos += 4;
+        } else if (type == 'g') {
+            pos += msg->data[pos] + 2;
+        } else if (type == 's' || type == 'o') {
+            const char* s = get_string(msg->data, end, &pos);
+            if (s == NULL) return -1;
+            if (code == DBUS_FIELD_MEMBER) hdr->member = s;
+            if (code == DBUS_FIELD_ERROR_NAME) hdr->error_name = s;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int dbus_readable (int fd) {
+    struct timespec now;
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) return 0;
+
+        int n = poll(&p, 1, ms);
+        if (n > 0) return 1;
+        if (n == 0 || errno != EINTR) return 0;
+    }
+}
+
+static int dbus_wait_reply (int fd, uint32_t expect, struct dbus_msg* msg, struct dbus_header* hdr) {
+    if (expect == 0) return -1;
+
+    for (;;) {
+        if (dbus_read(fd, msg, hdr) < 0) return -1;
+        if (hdr->reply_serial != expect) continue;
+
+        if (hdr->type == DBUS_ERROR) {
+            size_t pos = 0;
+            const char* text = get_string(hdr->body, hdr->body_len, &pos);
+            fprintf(stderr, "D-Bus error: %s: %s\n",
+                hdr->error_name ? hdr->error_name : "unknown", text ? text : "");
+            return -1;
+        }
+
+        if (hdr->type == DBUS_METHOD_RETURN) return 0;
+    }
+}
+
+
+static void put_align (struct dbus_msg* m, size_t n) {
+    while (m->len % n && m->len < sizeof(m->data)) m->data[m->len++] = 0;
+}
+
+static void put_byte (struct dbus_msg* m, unsigned char b) {
+    if (m->len < sizeof(m->data)) m->data[m->len++] = b;
+}
+
+static void put_u32 (struct dbus_msg* m, uint32_t v) {
+    put_align(m, 4);
+    if (m->len + 4 > sizeof(m->data)) return;
+    memcpy(m->data + m->len, &v, 4);
+    m->len += 4;
+}
+
+static void put_string (struct dbus_msg* m, const char* s) {
+    size_t n = strlen(s);
+    put_u32(m, n);
+    if (m->len + n + 1 > sizeof(m->data)) return;
+    memcpy(m->data + m->len, s, n + 1);
+    m->len += n + 1;
+}
+
+static void put_signature (struct dbus_msg* m, const char* s) {
+    size_t n = strlen(s);
+    put_byte(m, n);
+    if (m->len + n + 1 > sizeof(m->data)) return;
+    memcpy(m->data + m->len, s, n + 1);
+    m->len += n + 1;
+}
+
+static void put_field (struct dbus_msg* m, unsigned char code, char type, const char* value) {
+    char sig[2] = { type, 0 };
+
+    put_align(m, 8);
+    put_byte(m, code);
+    put_signature(m, sig);
+
+    if (type == 'g') put_signature(m, value);
+    else put_string(m, value);
+}
+
+// Read a 's' or 'o' value at *pos, advancing past its terminating nul.
+static const char* get_string (const unsigned char* data, size_t len, size_t* pos) {
+    uint32_t n;
+    size_t p = (*pos + 3) & ~3;
+
+    if (data == NULL || p + 4 > len) return NULL;
+    memcpy(&n, data + p, 4);
+    p += 4;
+    if (p + n + 1 > len || data[p + n] != 0) return NULL;
+
+    *pos = p + n + 1;
+    return (const char*)data + p;
+}
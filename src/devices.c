@@ -0,0 +1,156 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Device power management: PCI and USB runtime PM, SATA link power, ASPM and HDA audio.
+//
+// Devices are enumerated once and kept, with their files open, until devices_rescan(). Allow and
+// deny lists don't change what's enumerated, only which entries a write skips.
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+#define DEVICE_NAME_MAX 32
+
+// The files behind one device knob, and which device each belongs to.
+struct device_files {
+    struct sysfs_group group;
+    char (*names)[DEVICE_NAME_MAX];  // e.g. 0000:00:14.0, 1-2 or host0.
+    char (*ids)[DEVICE_NAME_MAX];    // vendor:product, or "" if there's no such thing.
+    int filtered;                    // Whether allow and deny lists apply.
+};
+
+static struct device_files files[K_COUNT];
+static int enumerated = 0;
+
+static void enumerate ();   // Find every device and module parameter behind each knob.
+static void scan_bus (int knob, const char* dir, const char* attr, const char* vendor, const char* product);
+static void add_file (int knob, const char* path, const char* name, const char* id);
+static int matches (const char* list, const char* name, const char* id);
+static const char* strip_hex (const char* id);                 // PCI IDs read back as 0x8086.
+
+
+struct sysfs_group* device_files (int knob) {
+    if (!enumerated) enumerate();
+    return files[knob].group.count ? &files[knob].group : NULL;
+}
+
+int devices_apply (int knob, const char* value, const char* allow, const char* deny, int force) {
+    struct sysfs_group* g = device_files(knob);
+    struct device_files* d = &files[knob];
+    if (g == NULL) return -1;
+
+    for (int i = 0; i < g->count; i++) {
+        g->skip[i] = d->filtered && ((allow[0] && !matches(allow, d->names[i], d->ids[i])) ||
+                                     (deny[0] && matches(deny, d->names[i], d->ids[i])));
+    }
+
+    sysfs_group_write(g, value, PWR_MAX_THREADS, force);
+
+    int changed = 0;
+    for (int i = 0; i < g->count; i++)
+        changed += g->changed[i] && !g->errors[i];
+
+    return changed;
+}
+
+void devices_discover () {
+    if (!enumerated) enumerate();
+}
+
+void devices_rescan () {
+    for (int k = 0; k < K_COUNT; k++) {
+        sysfs_group_free(&files[k].group);
+        free(files[k].names);
+        free(files[k].ids);
+        memset(&files[k], 0, sizeof(files[k]));
+    }
+
+    enumerated = 0;
+}
+
+
+static void enumerate () {
+    enumerated = 1;
+
+    scan_bus(K_PCI_PM, "/sys/bus/pci/devices", "power/control", "vendor", "device");
+    scan_bus(K_USB_PM, "/sys/bus/usb/devices", "power/control", "idVendor", "idProduct");
+    scan_bus(K_USB_AUTOSUSPEND, "/sys/bus/usb/devices", "power/autosuspend_delay_ms", "idVendor", "idProduct");
+    scan_bus(K_SATA_LPM, "/sys/class/scsi_host", "link_power_management_policy", NULL, NULL);
+
+    // Module-wide, so there's nothing to allow or deny.
+    add_file(K_ASPM, "/sys/module/pcie_aspm/parameters/policy", "pcie_aspm", "");
+    add_file(K_AUDIO_PM, "/sys/module/snd_hda_intel/parameters/power_save", "snd_hda_intel", "");
+    files[K_ASPM].filtered = files[K_AUDIO_PM].filtered = 0;
+}
+
+static void scan_bus (int knob, const char* dir, const char* attr, const char* vendor, const char* product) {
+    char path[512], v[16], p[16], id[DEVICE_NAME_MAX];
+
+    DIR* d = sysfs_opendir(dir);
+    if (d == NULL) return;
+
+    for (struct dirent* ent; (ent = readdir(d)) != NULL; ) {
+        // USB interfaces (1-2:1.0) are suspended along with their device. PCI addresses all have colons.
+        if (ent->d_name[0] == '.' || (knob != K_PCI_PM && strchr(ent->d_name, ':'))) continue;
+
+        id[0] = 0;
+        if (vendor != NULL) {
+            snprintf(path, sizeof(path), "%s/%s/%s", dir, ent->d_name, vendor);
+            int ok = sysfs_read(path, v, sizeof(v)) == 0;
+            snprintf(path, sizeof(path), "%s/%s/%s", dir, ent->d_name, product);
+            ok = ok && sysfs_read(path, p, sizeof(p)) == 0;
+
+            if (ok) snprintf(id, sizeof(id), "%s:%s", strip_hex(v), strip_hex(p));
+        }
+
+        snprintf(path, sizeof(path), "%s/%s/%s", dir, ent->d_name, attr);
+        add_file(knob, path, ent->d_name, id);
+    }
+
+    closedir(d);
+    files[knob].filtered = 1;
+}
+
+static void add_file (int knob, const char* path, const char* name, const char* id) {
+    struct device_files* d = &files[knob];
+    char value[8];
+
+    // Plenty of devices don't support runtime PM at all.
+    if (sysfs_read(path, value, sizeof(value)) < 0) return;
+
+    int i = sysfs_group_add(&d->group, path);
+    d->names = realloc(d->names, d->group.count * sizeof(*d->names));
+    d->ids = realloc(d->ids, d->group.count * sizeof(*d->ids));
+    snprintf(d->names[i], sizeof(d->names[i]), "%s", name);
+    snprintf(d->ids[i], sizeof(d->ids[i]), "%s", id);
+}
+
+static int matches (const char* list, const char* name, const char* id) {
+    char pattern[PROFILE_VALUE_MAX];
+    const char* end;
+
+    // Space-separated shell patterns, matching either the device name or its ID.
+    for (; *list; list = *end ? end + 1 : end) {
+        end = list + strcspn(list, " ,");
+        if (end == list || end - list >= (long)sizeof(pattern)) continue;
+
+        memcpy(pattern, list, end - list);
+        pattern[end - list] = 0;
+        if (!fnmatch(pattern, name, 0) || (id[0] && !fnmatch(pattern, id, 0))) return 1;
+    }
+
+    return 0;
+}
+
+static const char* strip_hex (const char* id) {
+    return strncmp(id, "0x", 2) ? id : id + 2;
+}
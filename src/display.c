@@ -0,0 +1,402 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// The internal panel: its refresh rate through DRM atomic modesetting, and its backlight.
+//
+// The connector, CRTC and property IDs are looked up once and kept until display_rescan(); the
+// card itself is only opened for the moment it takes to switch, since whoever opens it first
+// while nobody is DRM master becomes master, and that must stay the compositor.
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <config.h>
+#include "pwr.h"
+
+#if PWR_WITH_DRM
+
+// The few pieces of the DRM uapi (drm.h, drm_mode.h) that are needed, so that neither libdrm nor
+// the kernel's DRM headers are required to build.
+struct drm_set_client_cap { uint64_t capability, value; };
+
+struct drm_mode_card_res {
+    uint64_t fb_id_ptr, crtc_id_ptr, connector_id_ptr, encoder_id_ptr;
+    uint32_t count_fbs, count_crtcs, count_connectors, count_encoders;
+    uint32_t min_width, max_width, min_height, max_height;
+};
+
+struct drm_mode_modeinfo {
+    uint32_t clock;
+    uint16_t hdisplay, hsync_start, hsync_end, htotal, hskew;
+    uint16_t vdisplay, vsync_start, vsync_end, vtotal, vscan;
+    uint32_t vrefresh, flags, type;
+    char name[32];
+};
+
+struct drm_mode_crtc {
+    uint64_t set_connectors_ptr;
+    uint32_t count_connectors, crtc_id, fb_id, x, y, gamma_size, mode_valid;
+    struct drm_mode_modeinfo mode;
+};
+
+struct drm_mode_get_encoder { uint32_t encoder_id, encoder_type, crtc_id, possible_crtcs, possible_clones; };
+
+struct drm_mode_get_connector {
+    uint64_t encoders_ptr, modes_ptr, props_ptr, prop_values_ptr;
+    uint32_t count_modes, count_props, count_encoders, encoder_id, connector_id, connector_type;
+    uint32_t connector_type_id, connection, mm_width, mm_height, subpixel, pad;
+};
+
+struct drm_mode_obj_get_properties { uint64_t props_ptr, prop_values_ptr; uint32_t count_props, obj_id, obj_type; };
+
+struct drm_mode_get_property {
+    uint64_t values_ptr, enum_blob_ptr;
+    uint32_t prop_id, flags;
+    char name[32];
+    uint32_t count_values, count_enum_blobs;
+};
+
+struct drm_mode_create_blob { uint64_t data; uint32_t length, blob_id; };
+struct drm_mode_destroy_blob { uint32_t blob_id; };
+
+struct drm_mode_atomic {
+    uint32_t flags, count_objs;
+    uint64_t objs_ptr, count_props_ptr, props_ptr, prop_values_ptr, reserved, user_data;
+};
+
+#define DRM_IOCTL_SET_CLIENT_CAP _IOW('d', 0x0d, struct drm_set_client_cap)
+#define DRM_IOCTL_SET_MASTER _IO('d', 0x1e)
+#define DRM_IOCTL_DROP_MASTER _IO('d', 0x1f)
+#define DRM_IOCTL_MODE_GETRESOURCES _IOWR('d', 0xa0, struct drm_mode_card_res)
+#define DRM_IOCTL_MODE_GETCRTC _IOWR('d', 0xa1, struct drm_mode_crtc)
+#define DRM_IOCTL_MODE_GETENCODER _IOWR('d', 0xa6, struct drm_mode_get_encoder)
+#define DRM_IOCTL_MODE_GETCONNECTOR _IOWR('d', 0xa7, struct drm_mode_get_connector)
+#define DRM_IOCTL_MODE_GETPROPERTY _IOWR('d', 0xaa, struct drm_mode_get_property)
+#define DRM_IOCTL_MODE_OBJ_GETPROPERTIES _IOWR('d', 0xb9, struct drm_mode_obj_get_properties)
+#define DRM_IOCTL_MODE_ATOMIC _IOWR('d', 0xbc, struct drm_mode_atomic)
+#define DRM_IOCTL_MODE_CREATEPROPBLOB _IOWR('d', 0xbd, struct drm_mode_create_blob)
+#define DRM_IOCTL_MODE_DESTROYPROPBLOB _IOWR('d', 0xbe, struct drm_mode_destroy_blob)
+
+#define DRM_CLIENT_CAP_ATOMIC 3
+#define DRM_MODE_OBJECT_CRTC 0xccccccccU
+#define DRM_MODE_ATOMIC_ALLOW_MODESET 0x0400
+#define DRM_MODE_FLAG_INTERLACE (1 << 4)
+#define DRM_MODE_CONNECTED 1
+
+enum { CONNECTOR_LVDS = 7, CONNECTOR_EDP = 14, CONNECTOR_DSI = 16 };
+
+#define MAX_MODES 64
+
+// The panel, once found.
+static struct {
+    char card[64];                  // e.g. /dev/dri/card1
+    char name[32];                  // e.g. eDP-1
+    uint32_t crtc, mode_prop;       // Its CRTC, and that CRTC's MODE_ID property.
+    int modes;
+    struct drm_mode_modeinfo mode[MAX_MODES];
+} panel;
+
+static int probed = 0;
+static struct drm_mode_modeinfo previous;  // Mode before the last switch, for undo.
+static int switched = 0;
+
+static void probe ();
+static int probe_card (const char* path);
+static uint32_t crtc_property (int fd, uint32_t crtc, const char* name);
+static int current_mode (int fd, struct drm_mode_modeinfo* mode);
+static int commit_mode (int fd, const struct drm_mode_modeinfo* mode);
+static double refresh_of (const struct drm_mode_modeinfo* mode);
+
+#endif
+
+static struct sysfs_group backlight;
+static long backlight_max;
+static int backlight_probed = 0;
+
+static void probe_backlight ();
+
+
+#if PWR_WITH_DRM
+
+const char* display_panel () {
+    if (!probed) probe();
+    return panel.crtc ? panel.name : NULL;
+}
+
+int display_refresh () {
+    struct drm_mode_modeinfo mode;
+    if (display_panel() == NULL) return -1;
+
+    int fd = sysfs_open(panel.card, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int ok = current_mode(fd, &mode) == 0;
+    close(fd);
+
+    return ok ? (int)(refresh_of(&mode) + 0.5) : -1;
+}
+
+int display_set_refresh (const char* value, int force) {
+    struct drm_mode_modeinfo now;
+    const struct drm_mode_modeinfo* best = NULL;
+    double want = atof(value);
+
+    if (display_panel() == NULL) return -1;
+    if (want <= 0 && strcmp(value, "max") && strcmp(value, "min")) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = sysfs_open(panel.card, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (current_mode(fd, &now) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Same resolution, closest refresh rate; "max" and "min" pick the extremes.
+    for (int i = 0; i < panel.modes; i++) {
+        const struct drm_mode_modeinfo* m = &panel.mode[i];
+        if (m->hdisplay != now.hdisplay || m->vdisplay != now.vdisplay || (m->flags & DRM_MODE_FLAG_INTERLACE)) continue;
+
+        double hz = refresh_of(m), best_hz = best ? refresh_of(best) : 0;
+        if (best == NULL ||
+            (!strcmp(value, "max") && hz > best_hz) || (!strcmp(value, "min") && hz < best_hz) ||
+            (want > 0 && (hz > want ? hz - want : want - hz) < (best_hz > want ? best_hz - want : want - best_hz)))
+            best = m;
+    }
+
+    if (best == NULL || (!force && refresh_of(best) == refresh_of(&now) && best->clock == now.clock)) {
+        close(fd);
+        return best == NULL ? -1 : 0;
+    }
+
+    // Only DRM master may commit. While the compositor holds it, it has to make the change itself.
+    if (ioctl(fd, DRM_IOCTL_SET_MASTER, 0) < 0) {
+        close(fd);
+        errno = EBUSY;
+        return -2;
+    }
+
+    int result = commit_mode(fd, best);
+    if (result == 0) {
+        previous = now;
+        switched = 1;
+    }
+
+    ioctl(fd, DRM_IOCTL_DROP_MASTER, 0);
+    close(fd);
+    return result == 0 ? 1 : -1;
+}
+
+int display_refresh_undo () {
+    if (!switched) return 0;
+    switched = 0;
+
+    int fd = sysfs_open(panel.card, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    int result = ioctl(fd, DRM_IOCTL_SET_MASTER, 0) < 0 ? -1 : commit_mode(fd, &previous);
+    ioctl(fd, DRM_IOCTL_DROP_MASTER, 0);
+    close(fd);
+    return result;
+}
+
+#else
+
+// Built without DRM: there's never a panel to switch.
+const char* display_panel () { return NULL; }
+int display_refresh () { return -1; }
+int display_set_refresh (const char* value, int force) { return -1; }
+int display_refresh_undo () { return 0; }
+
+#endif
+
+struct sysfs_group* backlight_files () {
+    if (!backlight_probed) probe_backlight();
+    return backlight.count ? &backlight : NULL;
+}
+
+const char* backlight_value (const char* value) {
+    static char raw[32];
+    size_t len = strlen(value);
+
+    // Percentages of max_brightness; never all the way to 0, which turns some panels off.
+    if (len == 0 || value[len - 1] != '%' || backlight_max <= 0) return value;
+
+    long level = atol(value) * backlight_max / 100;
+    snprintf(raw, sizeof(raw), "%ld", level > 0 ? level : 1);
+    return raw;
+}
+
+void display_rescan () {
+#if PWR_WITH_DRM
+    memset(&panel, 0, sizeof(panel));
+    probed = 0;
+    switched = 0;
+#endif
+
+    sysfs_group_free(&backlight);
+    backlight_probed = 0;
+}
+
+
+#if PWR_WITH_DRM
+
+static void probe () {
+    glob_t results = { 0 };
+    probed = 1;
+
+    if (sysfs_glob("/dev/dri/card[0-9]*", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc && !panel.crtc; i++)
+            probe_card(results.gl_pathv[i]);
+    }
+
+    globfree(&results);
+}
+
+static int probe_card (const char* path) {
+    static const char* types[] = { [CONNECTOR_LVDS] = "LVDS", [CONNECTOR_EDP] = "eDP", [CONNECTOR_DSI] = "DSI" };
+    struct drm_mode_card_res res = { 0 };
+    uint32_t connectors[32];
+
+    int fd = sysfs_open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0 || res.count_connectors == 0) goto done;
+
+    res.count_connectors = res.count_connectors < 32 ? res.count_connectors : 32;
+    res.connector_id_ptr = (uint64_t)(uintptr_t)connectors;
+    res.count_fbs = res.count_crtcs = res.count_encoders = 0;
+    if (ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) goto done;
+
+    for (uint32_t i = 0; i < res.count_connectors && !panel.crtc; i++) {
+        // First find out how many modes there are, then fetch them.
+        struct drm_mode_get_connector c = { .connector_id = connectors[i] };
+        if (ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &c) < 0) continue;
+
+        int internal = c.connector_type == CONNECTOR_LVDS || c.connector_type == CONNECTOR_EDP ||
+                       c.connector_type == CONNECTOR_DSI;
+        if (!internal || c.connection != DRM_MODE_CONNECTED || c.encoder_id == 0 || c.count_modes == 0) continue;
+
+        panel.modes = c.count_modes < MAX_MODES ? c.count_modes : MAX_MODES;
+        c = (struct drm_mode_get_connector){ .connector_id = connectors[i], .count_modes = panel.modes,
+                                              .modes_ptr = (uint64_t)(uintptr_t)panel.mode };
+        if (ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &c) < 0) continue;
+        if (c.count_modes < (uint32_t)panel.modes) panel.modes = c.count_modes;
+
+        struct drm_mode_get_encoder e = { .encoder_id = c.encoder_id };
+        if (ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &e) < 0 || e.crtc_id == 0) continue;
+
+        // Atomic properties are only visible to clients that ask for them.
+        struct drm_set_client_cap cap = { DRM_CLIENT_CAP_ATOMIC, 1 };
+        if (ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) < 0) continue;
+
+        panel.mode_prop = crtc_property(fd, e.crtc_id, "MODE_ID");
+        if (panel.mode_prop == 0) continue;
+
+        snprintf(panel.card, sizeof(panel.card), "%s", path);
+        snprintf(panel.name, sizeof(panel.name), "%s-%u", types[c.connector_type], c.connector_type_id);
+        panel.crtc = e.crtc_id;
+    }
+
+done:
+    close(fd);
+    return panel.crtc ? 0 : -1;
+}
+
+static uint32_t crtc_property (int fd, uint32_t crtc, const char* name) {
+    uint32_t props[64];
+    uint64_t values[64];
+
+    struct drm_mode_obj_get_properties list = {
+        (uint64_t)(uintptr_t)props, (uint64_t)(uintptr_t)values, 64, crtc, DRM_MODE_OBJECT_CRTC
+    };
+    if (ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &list) < 0) return 0;
+
+    for (uint32_t i = 0; i < list.count_props && i < 64; i++) {
+        struct drm_mode_get_property prop = { .prop_id = props[i] };
+        if (ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == 0 && !strcmp(prop.name, name)) return props[i];
+    }
+
+    return 0;
+}
+
+static int current_mode (int fd, struct drm_mode_modeinfo* mode) {
+    struct drm_mode_crtc crtc = { .crtc_id = panel.crtc };
+    if (ioctl(fd, DRM_IOCTL_MODE_GETCRTC, &crtc) < 0 || !crtc.mode_valid) return -1;
+
+    *mode = crtc.mode;
+    return 0;
+}
+
+static int commit_mode (int fd, const struct drm_mode_modeinfo* mode) {
+    struct drm_mode_create_blob blob = { (uint64_t)(uintptr_t)mode, sizeof(*mode), 0 };
+    struct drm_set_client_cap cap = { DRM_CLIENT_CAP_ATOMIC, 1 };
+
+    if (ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) < 0) return -1;
+    if (ioctl(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob) < 0) return -1;
+
+    // One object, one property: the CRTC's mode. Everything else stays as the compositor set it.
+    uint32_t objs[] = { panel.crtc }, counts[] = { 1 }, props[] = { panel.mode_prop };
+    uint64_t values[] = { blob.blob_id };
+    struct drm_mode_atomic commit = {
+        DRM_MODE_ATOMIC_ALLOW_MODESET, 1,
+        (uint64_t)(uintptr_t)objs, (uint64_t)(uintptr_t)counts, (uint64_t)(uintptr_t)props,
+        (uint64_t)(uintptr_t)values, 0, 0
+    };
+
+    int result = ioctl(fd, DRM_IOCTL_MODE_ATOMIC, &commit);
+
+    // The CRTC keeps its own reference to the blob.
+    struct drm_mode_destroy_blob destroy = { blob.blob_id };
+    ioctl(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+    return result < 0 ? -1 : 0;
+}
+
+static double refresh_of (const struct drm_mode_modeinfo* mode) {
+    // vrefresh is rounded to whole Hz, so 59.94 and 60 would look the same.
+    if (mode->htotal && mode->vtotal) return mode->clock * 1000.0 / ((double)mode->htotal * mode->vtotal);
+    return mode->vrefresh;
+}
+
+#endif
+
+static void probe_backlight () {
+    static const char* preferred[] = { "firmware", "platform", "raw" };
+    glob_t results = { 0 };
+    char path[512], type[16], max[32];
+
+    backlight_probed = 1;
+    if (sysfs_glob("/sys/class/backlight/*", 0, NULL, &results) != 0) {
+        globfree(&results);
+        return;
+    }
+
+    // The same panel often shows up more than once (acpi_video0 and intel_backlight); the
+    // firmware interface comes first, as in systemd-backlight, then the platform one.
+    for (size_t t = 0; t < sizeof(preferred) / sizeof(preferred[0]) && !backlight.count; t++) {
+        for (size_t i = 0; i < results.gl_pathc && !backlight.count; i++) {
+            snprintf(path, sizeof(path), "%s/type", results.gl_pathv[i]);
+            if (sysfs_read(path, type, sizeof(type)) < 0 || strcmp(type, preferred[t])) continue;
+
+            snprintf(path, sizeof(path), "%s/max_brightness", results.gl_pathv[i]);
+            if (sysfs_read(path, max, sizeof(max)) < 0) continue;
+            backlight_max = atol(max);
+
+            snprintf(path, sizeof(path), "%s/brightness", results.gl_pathv[i]);
+            sysfs_group_add(&backlight, path);
+        }
+    }
+
+    globfree(&results);
+}
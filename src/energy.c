@@ -0,0 +1,171 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Energy use from RAPL powercap counters and the battery.
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+static int read_u64 (int fd, uint64_t* out);  // pread() a decimal attribute from the start.
+static int open_attr (const char* dir, const char* name);
+static void open_battery (struct energy_meter* m);
+
+
+int energy_open (struct energy_meter* m) {
+    glob_t results = { 0 };
+    char path[512];
+
+    memset(m, 0, sizeof(*m));
+    m->power_fd = m->current_fd = m->voltage_fd = m->energy_fd = -1;
+
+    // Sub-zones (core, uncore, dram) show up here alongside the packages.
+    if (sysfs_glob("/sys/class/powercap/intel-rapl:*", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc && m->zones < ENERGY_MAX_ZONES; i++) {
+            struct energy_zone* z = &m->zone[m->zones];
+
+            snprintf(path, sizeof(path), "%s/name", results.gl_pathv[i]);
+            if (sysfs_read(path, z->name, sizeof(z->name)) < 0) continue;
+
+            z->fd = open_attr(results.gl_pathv[i], "energy_uj");
+            if (z->fd < 0) continue;
+
+            int range = open_attr(results.gl_pathv[i], "max_energy_range_uj");
+            if (range < 0 || read_u64(range, &z->range) < 0) z->range = 0;
+            if (range >= 0) close(range);
+
+            if (read_u64(z->fd, &z->last) < 0) {
+                close(z->fd);
+                continue;
+            }
+
+            m->zones++;
+        }
+    }
+
+    globfree(&results);
+    open_battery(m);
+
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+    return m->zones + (m->power_fd >= 0 || m->current_fd >= 0 || m->energy_fd >= 0);
+}
+
+void energy_sample (struct energy_meter* m) {
+    uint64_t now, a, b;
+
+    for (int i = 0; i < m->zones; i++) {
+        struct energy_zone* z = &m->zone[i];
+        if (read_u64(z->fd, &now) < 0) continue;
+
+        // The counter wraps at max_energy_range_uj, so sample often enough to see at most one wrap.
+        uint64_t delta = now >= z->last ? now - z->last : z->range - z->last + now;
+        z->joules += delta / 1e6;
+        z->last = now;
+    }
+
+    // power_now is in microwatts; some batteries only give current and voltage instead.
+    if (m->power_fd >= 0 && read_u64(m->power_fd, &a) == 0) {
+        m->battery_watts += a / 1e6;
+        m->battery_samples++;
+    } else if (m->current_fd >= 0 && read_u64(m->current_fd, &a) == 0 && read_u64(m->voltage_fd, &b) == 0) {
+        m->battery_watts += (a / 1e6) * (b / 1e6);
+        m->battery_samples++;
+    }
+
+    if (m->energy_fd >= 0 && read_u64(m->energy_fd, &a) == 0) m->energy_last = a;
+}
+
+double energy_elapsed (const struct energy_meter* m) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - m->start.tv_sec) + (now.tv_nsec - m->start.tv_nsec) / 1e9;
+}
+
+double energy_battery_watts (const struct energy_meter* m) {
+    if (m->battery_samples > 0) return m->battery_watts / m->battery_samples;
+
+    // Fall back on the drop in energy_now (microwatt-hours), which the EC only updates now and then.
+    double hours = energy_elapsed(m) / 3600;
+    if (m->energy_fd >= 0 && hours > 0 && m->energy_first >= m->energy_last)
+        return (m->energy_first - m->energy_last) / 1e6 / hours;
+
+    return -1;
+}
+
+void energy_close (struct energy_meter* m) {
+    for (int i = 0; i < m->zones; i++)
+        close(m->zone[i].fd);
+
+    int fds[] = { m->power_fd, m->current_fd, m->voltage_fd, m->energy_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+        if (fds[i] >= 0) close(fds[i]);
+
+    memset(m, 0, sizeof(*m));
+}
+
+
+static int read_u64 (int fd, uint64_t* out) {
+    char buf[32];
+    ssize_t got = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (got <= 0) return -1;
+
+    buf[got] = 0;
+    *out = strtoull(buf, NULL, 10);
+    return 0;
+}
+
+static int open_attr (const char* dir, const char* name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return sysfs_open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void open_battery (struct energy_meter* m) {
+    glob_t results = { 0 };
+    char path[512], value[32];
+
+    if (sysfs_glob("/sys/class/power_supply/*", 0, NULL, &results) != 0) {
+        globfree(&results);
+        return;
+    }
+
+    for (size_t i = 0; i < results.gl_pathc; i++) {
+        snprintf(path, sizeof(path), "%s/type", results.gl_pathv[i]);
+        if (sysfs_read(path, value, sizeof(value)) < 0 || strcmp(value, "Battery")) continue;
+
+        snprintf(path, sizeof(path), "%s/status", results.gl_pathv[i]);
+        if (sysfs_read(path, m->battery_status, sizeof(m->battery_status)) < 0)
+            m->battery_status[0] = 0;
+
+        m->power_fd = open_attr(results.gl_pathv[i], "power_now");
+        if (m->power_fd < 0) {
+            m->current_fd = open_attr(results.gl_pathv[i], "current_now");
+            m->voltage_fd = open_attr(results.gl_pathv[i], "voltage_now");
+
+            // Either one is useless without the other.
+            if (m->current_fd < 0 || m->voltage_fd < 0) {
+                if (m->current_fd >= 0) close(m->current_fd);
+                if (m->voltage_fd >= 0) close(m->voltage_fd);
+                m->current_fd = m->voltage_fd = -1;
+            }
+        }
+
+        m->energy_fd = open_attr(results.gl_pathv[i], "energy_now");
+        if (m->energy_fd >= 0 && read_u64(m->energy_fd, &m->energy_first) == 0)
+            m->energy_last = m->energy_first;
+
+        break;
+    }
+
+    globfree(&results);
+}
@@ -0,0 +1,111 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Discrete GPU power through PCI runtime PM.
+//
+// With render offload the integrated GPU drives the display and the discrete one only wakes up
+// for work sent to it, so it can be powered down and up again without touching the session.
+
+#include <glob.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "pwr.h"
+
+static char device[256];             // sysfs directory of the discrete GPU, once found.
+static struct sysfs_group function;  // Its power/control.
+static struct sysfs_group slot;      // power/control of every function in its slot.
+static struct sysfs_group* written;  // Whichever of the two was written last.
+static int probed = 0;
+
+static void probe ();
+static void add_function ();  // Put the GPU's own power/control in function.
+
+
+const char* gpu_discrete () {
+    if (!probed) probe();
+    return device[0] ? device : NULL;
+}
+
+int gpu_runtime_pm (const char* control, int all, int force) {
+    if (gpu_discrete() == NULL) return -1;
+
+    struct sysfs_group* g = written = all ? &slot : &function;
+    int failed = sysfs_group_write(g, control, g->count, force), changed = 0;
+
+    for (int i = 0; i < g->count; i++)
+        changed += g->changed[i] && !g->errors[i];
+
+    if (failed) {
+        fprintf(stderr, "GPU runtime PM: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return changed;
+}
+
+int gpu_runtime_pm_undo () {
+    return written ? sysfs_group_undo(written) : 0;
+}
+
+const char* gpu_runtime_status () {
+    static char status[32];
+    char path[512];
+
+    if (gpu_discrete() == NULL) return NULL;
+
+    snprintf(path, sizeof(path), "%s/power/runtime_status", device);
+    return sysfs_read(path, status, sizeof(status)) == 0 ? status : NULL;
+}
+
+
+static void probe () {
+    glob_t results = { 0 };
+    char path[512], value[32];
+
+    probed = 1;
+
+    // "" means there's no discrete GPU.
+    char known[CAPS_VALUE_MAX];
+    if (caps_get("gpu.discrete", known, sizeof(known)) && (!known[0] || caps_get_group("gpu.slot", &slot))) {
+        snprintf(device, sizeof(device), "%s", known);
+        if (device[0]) add_function();
+        return;
+    }
+
+    // The discrete GPU is whichever display controller (class 0x03) the firmware didn't boot on.
+    if (sysfs_glob("/sys/bus/pci/devices/*/class", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc && !device[0]; i++) {
+            if (sysfs_read(results.gl_pathv[i], value, sizeof(value)) < 0 || strncmp(value, "0x03", 4)) continue;
+
+            char* dir = results.gl_pathv[i];
+            dir[strlen(dir) - strlen("/class")] = 0;
+
+            snprintf(path, sizeof(path), "%s/boot_vga", dir);
+            if (sysfs_read(path, value, sizeof(value)) == 0 && value[0] == '1') continue;
+
+            snprintf(device, sizeof(device), "%s", dir);
+        }
+    }
+
+    globfree(&results);
+    if (strrchr(device, '.') == NULL) device[0] = 0;
+    caps_set("gpu.discrete", device);
+    if (!device[0]) return;
+
+    // The HDMI audio and USB-C functions hold the whole card awake unless they suspend too.
+    snprintf(path, sizeof(path), "%.*s*/power/control", (int)(strrchr(device, '.') - device + 1), device);
+    sysfs_group_glob(&slot, path);
+    caps_set_group("gpu.slot", &slot);
+    add_function();
+}
+
+static void add_function () {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/power/control", device);
+    sysfs_group_add(&function, path);
+}
@@ -0,0 +1,350 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// pwr-helper: the only setuid part of pwr when it's built with PWR_SETUID off.
+//
+// pwr reads the current values itself, works out what has to change and sends it here in
+// batches: one "path value" line per write, then an empty line. Only root and members of
+// PWR_GROUP get that far. Every path is resolved and checked against the allow-list below, and
+// every value against what that knob takes, and the whole batch is written in one pass. The
+// reply is one line of errnos, 0 for each write that went through, in the order they were sent.
+// Nothing is executed, and nothing is read back but the choices and limits the kernel offers.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <config.h>
+#include "pwr.h"
+
+// How a value has to look to be written.
+enum check {
+    V_WORDS,    // One of words, or of the words in the sibling file, e.g. scaling_available_governors.
+    V_NUMBER,   // One of words, or an integer from min to max, or to what the sibling file holds.
+    V_CPU_MAX,  // cgroup cpu.max: "max" or a quota, and optionally a period.
+    V_CPUS,     // A CPU list, e.g. 0-3,8.
+    V_UCLAMP    // "max" or a percentage, e.g. 20.5.
+};
+
+#define POLICY "/sys/devices/system/cpu/cpufreq/policy[0-9]*"
+
+// What may be written, by resolved path. Patterns match with FNM_PATHNAME, so * stays within one
+// directory; a /**/ matches any number of them, so device paths can sit at any depth under
+// /sys/devices but never outside it. Class devices don't always sit in a directory named after
+// their class (an NVMe namespace or intel_backlight doesn't), so those are told apart by the
+// subsystem link of the device the file belongs to instead.
+static const struct {
+    const char* pattern;
+    int check;
+    const char* words;
+    const char* sibling;
+    long min, max;
+    int own_slice;  // Whether callers other than root are limited to their own user slice.
+    const char* subsystem;
+    int up;         // How many directories above the file the device with that subsystem is.
+} allowed[] = {
+    { POLICY "/scaling_governor", V_WORDS, .sibling = "scaling_available_governors" },
+    { POLICY "/energy_performance_preference", V_WORDS,
+      .sibling = "energy_performance_available_preferences" },
+    { POLICY "/scaling_min_freq", V_NUMBER, .sibling = "cpuinfo_max_freq" },
+    { POLICY "/scaling_max_freq", V_NUMBER, .sibling = "cpuinfo_max_freq" },
+    { POLICY "/boost", V_WORDS, .words = "0 1" },
+    { "/sys/devices/system/cpu/cpufreq/boost", V_WORDS, .words = "0 1" },
+    { "/sys/devices/system/cpu/intel_pstate/min_perf_pct", V_NUMBER, .min = 0, .max = 100 },
+    { "/sys/devices/system/cpu/intel_pstate/max_perf_pct", V_NUMBER, .min = 0, .max = 100 },
+    { "/sys/devices/system/cpu/intel_pstate/no_turbo", V_WORDS, .words = "0 1" },
+    { "/sys/devices/system/cpu/cpu[0-9]*/online", V_WORDS, .words = "0 1" },
+    { "/sys/devices/**/power/control", V_WORDS, .words = "auto on" },
+    { "/sys/devices/**/power/autosuspend_delay_ms", V_NUMBER, .min = -1, .max = 600000 },
+    { "/sys/devices/**/power/pm_qos_latency_tolerance_us", V_NUMBER, .words = "auto any",
+      .min = 0, .max = 1000000000 },
+    { "/sys/devices/**/scsi_host/host[0-9]*/link_power_management_policy", V_WORDS,
+      .words = "max_performance medium_power med_power_with_dipm min_power" },
+    { "/sys/devices/**/queue/scheduler", V_WORDS, .sibling = "scheduler", .subsystem = "block", .up = 2 },
+    { "/sys/devices/**/queue/read_ahead_kb", V_NUMBER, .min = 0, .max = 65536,
+      .subsystem = "block", .up = 2 },
+    { "/sys/devices/**/brightness", V_NUMBER, .sibling = "max_brightness", .subsystem = "backlight", .up = 1 },
+    { "/sys/devices/**/charge_control_start_threshold", V_NUMBER, .min = 0, .max = 100,
+      .subsystem = "power_supply", .up = 1 },
+    { "/sys/devices/**/charge_control_end_threshold", V_NUMBER, .min = 0, .max = 100,
+      .subsystem = "power_supply", .up = 1 },
+    { "/sys/firmware/acpi/platform_profile", V_WORDS, .sibling = "platform_profile_choices" },
+    { "/sys/module/pcie_aspm/parameters/policy", V_WORDS,
+      .words = "default performance powersave powersupersave" },
+    { "/sys/module/snd_hda_intel/parameters/power_save", V_NUMBER, .min = 0, .max = 3600 },
+    { "/sys/fs/cgroup/**/*.slice/cpu.max", V_CPU_MAX, .own_slice = 1 },
+    { "/sys/fs/cgroup/**/*.slice/cpu.weight", V_NUMBER, .min = 1, .max = 10000, .own_slice = 1 },
+    { "/sys/fs/cgroup/**/*.slice/cpuset.cpus", V_CPUS, .own_slice = 1 },
+    { "/sys/fs/cgroup/**/*.slice/cpu.uclamp.max", V_UCLAMP, .own_slice = 1 },
+    { "/proc/sys/vm/dirty_writeback_centisecs", V_NUMBER, .min = 0, .max = 360000 },
+    { "/proc/sys/vm/dirty_expire_centisecs", V_NUMBER, .min = 0, .max = 360000 },
+    { "/proc/sys/vm/laptop_mode", V_NUMBER, .min = 0, .max = 600 },
+    { .pattern = NULL }
+};
+
+static int authorized ();                      // Whether the caller is root or in PWR_GROUP.
+static int apply (char* line);                 // Validate and perform one write. Returns an errno or 0.
+static int valid_value (const char* value);    // Whether a value only holds characters knobs use.
+static int match (const char* pattern, const char* path);
+static int check_value (int i, const char* path, const char* value);  // Against allowed[i]'s rule.
+static int own_slice (const char* path);       // Whether a cgroup is in the caller's user slice.
+static int in_subsystem (const char* path, int up, const char* subsystem);
+static int has_word (const char* list, const char* word);
+static int number (const char* value, long* out);  // Parse a whole integer. Returns 1 if it is one.
+static int write_state (const char* value);    // Replace the state file, as set_pwr_state() would.
+
+
+int main () {
+    char* line = NULL;
+    size_t len = 0;
+    int* results = NULL;
+    int count = 0, max = 0;
+
+    // Nothing from the caller's environment is used, but nothing it could change matters either.
+    umask(022);
+    clearenv();
+
+    if (!authorized()) {
+        fprintf(stderr, "pwr-helper: only root and members of group %s may switch modes\n", PWR_GROUP);
+        return 1;
+    }
+
+    while (getline(&line, &len, stdin) > 0) {
+        line[strcspn(line, "\n")] = 0;
+
+        // Replies wait for the whole batch, so pwr never blocks writing while this does too.
+        if (line[0]) {
+            if (count == max) results = realloc(results, (max = max ? max * 2 : 64) * sizeof(int));
+            results[count++] = apply(line);
+            continue;
+        }
+
+        for (int i = 0; i < count; i++)
+            printf(i ? " %d" : "%d", results[i]);
+
+        putchar('\n');
+        if (fflush(stdout) != 0) break;
+        count = 0;
+    }
+
+    free(results);
+    free(line);
+    return 0;
+}
+
+
+static int authorized () {
+    if (getuid() == 0) return 1;
+
+    struct group* g = getgrnam(PWR_GROUP);
+    if (g == NULL) return 0;
+    if (getgid() == g->gr_gid) return 1;
+
+    int count = getgroups(0, NULL), found = 0;
+    gid_t* groups = count > 0 ? calloc(count, sizeof(gid_t)) : NULL;
+    if (groups != NULL) count = getgroups(count, groups);
+
+    for (int i = 0; groups != NULL && i < count && !found; i++)
+        found = groups[i] == g->gr_gid;
+
+    free(groups);
+    return found;
+}
+
+static int apply (char* line) {
+    char resolved[PATH_MAX], buf[SYSFS_VALUE_MAX + 1];
+
+    // Paths are never quoted; sysfs paths don't contain spaces. The value may be empty.
+    char* value = strchr(line, ' ');
+    if (value == NULL) return EINVAL;
+    *value++ = 0;
+
+    if (!valid_value(value)) return EINVAL;
+    if (!strcmp(line, STATE_FILE)) return write_state(value);
+
+    // Symlinks like /sys/class/... and /sys/block/... lead into /sys/devices; follow them first,
+    // so what gets checked is what gets written.
+    if (realpath(line, resolved) == NULL) return errno;
+
+    int i;
+    for (i = 0; allowed[i].pattern != NULL; i++) {
+        if (!match(allowed[i].pattern, resolved)) continue;
+        if (allowed[i].subsystem == NULL || in_subsystem(resolved, allowed[i].up, allowed[i].subsystem)) break;
+    }
+
+    if (allowed[i].pattern == NULL) return EPERM;
+    if (allowed[i].own_slice && !own_slice(resolved)) return EPERM;
+    if (!check_value(i, resolved, value)) return EINVAL;
+
+    int fd = open(resolved, O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return errno;
+
+    size_t n = snprintf(buf, sizeof(buf), "%s\n", value);
+    int result = pwrite(fd, buf, n, 0) == (ssize_t)n ? 0 : errno;
+    close(fd);
+    return result;
+}
+
+static int valid_value (const char* value) {
+    if (strlen(value) >= SYSFS_VALUE_MAX - 1) return 0;
+
+    // Governors, policies, numbers, CPU lists and "max 100000" for cpu.max.
+    for (; *value; value++)
+        if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ._:,+-", *value))
+            return 0;
+
+    return 1;
+}
+
+static int match (const char* pattern, const char* path) {
+    char head[PATH_MAX], start[PATH_MAX];
+
+    const char* any = strstr(pattern, "/**/");
+    if (any == NULL) return fnmatch(pattern, path, FNM_PATHNAME) == 0;
+
+    // The part before it has to match some leading directories, and the part after it (from its
+    // slash on) what's left after any number of directories more.
+    snprintf(head, sizeof(head), "%.*s", (int)(any - pattern), pattern);
+    for (const char* p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        snprintf(start, sizeof(start), "%.*s", (int)(p - path), path);
+        if (fnmatch(head, start, FNM_PATHNAME)) continue;
+
+        for (const char* q = p; q != NULL; q = strchr(q + 1, '/'))
+            if (fnmatch(any + 3, q, FNM_PATHNAME) == 0) return 1;
+    }
+
+    return 0;
+}
+
+static int check_value (int i, const char* path, const char* value) {
+    char sibling[PATH_MAX], list[SYSFS_VALUE_MAX * 4] = "";
+    long n, max = allowed[i].max;
+
+    // Choices and bounds that depend on the hardware come from the file's own directory.
+    if (allowed[i].sibling != NULL) {
+        snprintf(sibling, sizeof(sibling), "%.*s/%s", (int)(strrchr(path, '/') - path), path, allowed[i].sibling);
+        FILE* f = fopen(sibling, "r");
+        if (f == NULL) return 0;
+        if (fgets(list, sizeof(list), f) == NULL) list[0] = 0;
+        fclose(f);
+        list[strcspn(list, "\n")] = 0;
+        max = atol(list);
+    }
+
+    if (allowed[i].words != NULL && has_word(allowed[i].words, value)) return 1;
+
+    switch (allowed[i].check) {
+    case V_WORDS:
+        return allowed[i].sibling != NULL && has_word(list, value);
+
+    case V_NUMBER:
+        return number(value, &n) && n >= allowed[i].min && n <= max;
+
+    case V_CPU_MAX: {
+        // "max" or a quota in microseconds, then the period if it's given.
+        char quota[32] = "";
+        const char* period = strchr(value, ' ');
+        snprintf(quota, sizeof(quota), "%.*s", period ? (int)(period - value) : (int)strlen(value), value);
+
+        int ok = !strcmp(quota, "max") || (number(quota, &n) && n >= 1000);
+        return ok && (period == NULL || (number(period + 1, &n) && n >= 1000 && n <= 1000000));
+    }
+
+    case V_CPUS:
+        return strspn(value, "0123456789,-") == strlen(value);
+
+    case V_UCLAMP: {
+        char* end;
+        double pct = strtod(value, &end);
+        return !strcmp(value, "max") || (end != value && !*end && pct >= 0 && pct <= 100);
+    }
+    }
+
+    return 0;
+}
+
+static int own_slice (const char* path) {
+    char prefix[64];
+
+    // Everyone else's slices, and the system's, are only pwrd's to limit.
+    if (getuid() == 0) return 1;
+
+    int len = snprintf(prefix, sizeof(prefix), "/sys/fs/cgroup/user.slice/user-%d.slice/", (int)getuid());
+    return !strncmp(path, prefix, len);
+}
+
+static int in_subsystem (const char* path, int up, const char* subsystem) {
+    char link[PATH_MAX], target[PATH_MAX];
+    int len = strlen(path);
+
+    for (int n = 0; n < up; n++)
+        while (len > 0 && path[--len] != '/');
+
+    // The link leads to /sys/class/NAME (or /sys/bus/NAME) whatever the device's own path is.
+    snprintf(link, sizeof(link), "%.*s/subsystem", len, path);
+    if (realpath(link, target) == NULL) return 0;
+
+    const char* name = strrchr(target, '/');
+    return name != NULL && !strcmp(name + 1, subsystem);
+}
+
+static int has_word (const char* list, const char* word) {
+    size_t len = strlen(word);
+    if (len == 0) return 0;
+
+    // Lists read back with the current choice in brackets, like "none [mq-deadline] bfq".
+    for (const char* p = list; (p = strstr(p, word)) != NULL; p += len) {
+        int start = p == list || p[-1] == ' ' || p[-1] == '[';
+        int end = p[len] == ' ' || p[len] == ']' || p[len] == 0;
+        if (start && end) return 1;
+    }
+
+    return 0;
+}
+
+static int number (const char* value, long* out) {
+    char* end;
+    errno = 0;
+    *out = strtol(value, &end, 10);
+    return end != value && !*end && errno == 0;
+}
+
+static int write_state (const char* value) {
+    const char* tmp = STATE_DIR "/." STATE_NAME ".tmp";
+
+    char path[PATH_MAX];
+    struct stat st;
+
+    // Only the name of a profile that's there, built in or in a file root keeps.
+    if (!value[0] || value[0] == '.' || strlen(value) >= PROFILE_NAME_MAX ||
+        strspn(value, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") != strlen(value))
+        return EINVAL;
+
+    snprintf(path, sizeof(path), "%s/%s.conf", PWR_PROFILE_DIR, value);
+    if (strcmp(value, "perform") && strcmp(value, "powersave") && (stat(path, &st) < 0 || st.st_uid != 0))
+        return EINVAL;
+
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) return errno;
+
+    int ok = fprintf(f, "%s\n", value) > 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, STATE_FILE) < 0) {
+        int error = errno ? errno : EIO;
+        unlink(tmp);
+        return error;
+    }
+
+    return 0;
+}
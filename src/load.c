@@ -0,0 +1,97 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// System load, CPU pressure and temperature, for automatic switching.
+//
+// Everything is opened once and re-read with pread(), so a sample costs three or four syscalls.
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+static ssize_t read_at (int fd, char* buf, size_t len);  // pread() the whole file, nul-terminated.
+
+
+int load_open (struct load_meter* m) {
+    glob_t results = { 0 };
+
+    memset(m, 0, sizeof(*m));
+    m->stat_fd = sysfs_open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    m->psi_fd = sysfs_open("/proc/pressure/cpu", O_RDONLY | O_CLOEXEC);
+
+    if (sysfs_glob("/sys/class/thermal/thermal_zone*/temp", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc && m->zones < LOAD_MAX_ZONES; i++) {
+            int fd = sysfs_open(results.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) m->zone_fd[m->zones++] = fd;
+        }
+    }
+
+    globfree(&results);
+
+    // Prime the counters, so the first real sample covers a proper interval.
+    struct load_sample first;
+    load_sample(m, &first);
+    return m->stat_fd >= 0 ? 0 : -1;
+}
+
+void load_sample (struct load_meter* m, struct load_sample* s) {
+    char buf[4096];
+
+    s->busy = s->pressure = s->temp = -1;
+
+    // "cpu  user nice system idle iowait irq softirq steal ...", in ticks since boot.
+    if (m->stat_fd >= 0 && read_at(m->stat_fd, buf, sizeof(buf)) > 0 && !strncmp(buf, "cpu ", 4)) {
+        uint64_t total = 0, idle = 0, v[8] = { 0 };
+        char* p = buf + 4;
+
+        for (int i = 0; i < 8; i++) {
+            v[i] = strtoull(p, &p, 10);
+            total += v[i];
+        }
+        idle = v[3] + v[4];
+
+        if (m->total && total > m->total)
+            s->busy = 1.0 - (double)(idle - m->idle) / (total - m->total);
+
+        m->total = total;
+        m->idle = idle;
+    }
+
+    // "some avg10=1.23 avg60=... avg300=... total=..."
+    if (m->psi_fd >= 0 && read_at(m->psi_fd, buf, sizeof(buf)) > 0) {
+        char* avg = strstr(buf, "avg10=");
+        if (avg != NULL) s->pressure = atof(avg + 6);
+    }
+
+    // The hottest zone counts; temperatures are in millidegrees.
+    for (int i = 0; i < m->zones; i++) {
+        if (read_at(m->zone_fd[i], buf, sizeof(buf)) <= 0) continue;
+        double temp = atol(buf) / 1000.0;
+        if (temp > s->temp) s->temp = temp;
+    }
+}
+
+void load_close (struct load_meter* m) {
+    if (m->stat_fd >= 0) close(m->stat_fd);
+    if (m->psi_fd >= 0) close(m->psi_fd);
+    for (int i = 0; i < m->zones; i++)
+        close(m->zone_fd[i]);
+
+    memset(m, 0, sizeof(*m));
+}
+
+
+static ssize_t read_at (int fd, char* buf, size_t len) {
+    ssize_t got = pread(fd, buf, len - 1, 0);
+    buf[got > 0 ? got : 0] = 0;
+    return got;
+}
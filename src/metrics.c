@@ -0,0 +1,191 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Switch statistics and power readings in the Prometheus text format.
+//
+// Everything is recorded as it happens (each switch, each power sample), so writing the metrics
+// out only formats what's already in memory and never touches sysfs.
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+#define MAX_STEPS 16
+#define MAX_PROFILES 16
+
+// Upper bounds of the latency histogram buckets, in seconds.
+static const double buckets[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+#define BUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+static struct {
+    const char* name;
+    unsigned long counts[BUCKETS];  // Not cumulative; summed up when written.
+    unsigned long count;
+    double sum;
+} steps[MAX_STEPS];
+
+static struct {
+    char name[PROFILE_VALUE_MAX];
+    unsigned long ok, failed;
+} profiles[MAX_PROFILES];
+
+static int step_count = 0, profile_count = 0;
+
+// The last power sample, and what it was taken against.
+static struct {
+    int sampled;
+    double zone_watts[ENERGY_MAX_ZONES];
+    double zone_joules[ENERGY_MAX_ZONES];
+    double battery_watts;
+    double battery_sum;
+    int battery_samples;
+    double elapsed;
+    int ac;
+} power = { .battery_watts = -1, .ac = -1 };
+
+static const struct energy_meter* meter;
+
+static void label (FILE* f, const char* value);  // Print a label value, escaped.
+
+
+void metrics_switch (const char* profile, int ok) {
+    int i;
+    for (i = 0; i < profile_count && strcmp(profiles[i].name, profile); i++);
+
+    if (i == profile_count) {
+        if (profile_count == MAX_PROFILES) return;
+        snprintf(profiles[profile_count++].name, sizeof(profiles[i].name), "%s", profile);
+    }
+
+    if (ok) profiles[i].ok++;
+    else profiles[i].failed++;
+}
+
+void metrics_step (const char* step, double usec) {
+    int i;
+    for (i = 0; i < step_count && strcmp(steps[i].name, step); i++);
+
+    if (i == step_count) {
+        if (step_count == MAX_STEPS) return;
+        steps[step_count++].name = step;
+    }
+
+    double seconds = usec / 1e6;
+    size_t b;
+    for (b = 0; b < BUCKETS && seconds > buckets[b]; b++);
+
+    if (b < BUCKETS) steps[i].counts[b]++;
+    steps[i].count++;
+    steps[i].sum += seconds;
+}
+
+void metrics_power (const struct energy_meter* m, int ac) {
+    double elapsed = energy_elapsed(m), interval = elapsed - power.elapsed;
+    meter = m;
+
+    // Draw over the last interval rather than since startup, so it follows mode switches.
+    for (int i = 0; i < m->zones && interval > 0; i++) {
+        power.zone_watts[i] = (m->zone[i].joules - power.zone_joules[i]) / interval;
+        power.zone_joules[i] = m->zone[i].joules;
+    }
+
+    if (m->battery_samples > power.battery_samples) {
+        power.battery_watts = (m->battery_watts - power.battery_sum) / (m->battery_samples - power.battery_samples);
+        power.battery_sum = m->battery_watts;
+        power.battery_samples = m->battery_samples;
+    } else {
+        power.battery_watts = energy_battery_watts(m);
+    }
+
+    power.sampled = power.elapsed > 0;
+    power.elapsed = elapsed;
+    power.ac = ac;
+}
+
+void metrics_write (FILE* f, const char* state) {
+    fputs("# HELP pwr_state The profile pwr last switched to.\n# TYPE pwr_state gauge\npwr_state{state=\"", f);
+    label(f, state);
+    fputs("\"} 1\n", f);
+
+    fputs("# HELP pwr_switches_total Switches attempted, by profile and outcome.\n", f);
+    fputs("# TYPE pwr_switches_total counter\n", f);
+    for (int i = 0; i < profile_count; i++) {
+        for (int ok = 1; ok >= 0; ok--) {
+            fputs("pwr_switches_total{profile=\"", f);
+            label(f, profiles[i].name);
+            fprintf(f, "\",result=\"%s\"} %lu\n", ok ? "ok" : "failed", ok ? profiles[i].ok : profiles[i].failed);
+        }
+    }
+
+    fputs("# HELP pwr_switch_step_seconds Time taken by each part of a switch.\n", f);
+    fputs("# TYPE pwr_switch_step_seconds histogram\n", f);
+    for (int i = 0; i < step_count; i++) {
+        unsigned long cumulative = 0;
+
+        for (size_t b = 0; b < BUCKETS; b++) {
+            cumulative += steps[i].counts[b];
+            fprintf(f, "pwr_switch_step_seconds_bucket{step=\"%s\",le=\"%g\"} %lu\n", steps[i].name, buckets[b], cumulative);
+        }
+
+        fprintf(f, "pwr_switch_step_seconds_bucket{step=\"%s\",le=\"+Inf\"} %lu\n", steps[i].name, steps[i].count);
+        fprintf(f, "pwr_switch_step_seconds_sum{step=\"%s\"} %.9g\n", steps[i].name, steps[i].sum);
+        fprintf(f, "pwr_switch_step_seconds_count{step=\"%s\"} %lu\n", steps[i].name, steps[i].count);
+    }
+
+    // Nothing to report until two samples have gone by.
+    if (meter == NULL || !power.sampled) return;
+
+    if (meter->zones) {
+        fputs("# HELP pwr_rapl_watts Average RAPL power draw over the last sample interval.\n", f);
+        fputs("# TYPE pwr_rapl_watts gauge\n", f);
+        for (int i = 0; i < meter->zones; i++) {
+            fputs("pwr_rapl_watts{zone=\"", f);
+            label(f, meter->zone[i].name);
+            fprintf(f, "\"} %.3f\n", power.zone_watts[i]);
+        }
+    }
+
+    if (power.battery_watts >= 0) {
+        fputs("# HELP pwr_battery_watts Battery power draw over the last sample interval.\n", f);
+        fprintf(f, "# TYPE pwr_battery_watts gauge\npwr_battery_watts %.3f\n", power.battery_watts);
+    }
+
+    if (power.ac >= 0) {
+        fputs("# HELP pwr_ac_online Whether AC power was plugged in at the last sample.\n", f);
+        fprintf(f, "# TYPE pwr_ac_online gauge\npwr_ac_online %d\n", power.ac);
+    }
+}
+
+int metrics_save (const char* path, const char* state) {
+    char tmp[512];
+
+    // node_exporter may read it at any moment, so it has to appear whole.
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) return -1;
+
+    metrics_write(f, state);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void label (FILE* f, const char* value) {
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') fputc('\\', f);
+        if (*value == '\n') fputs("\\n", f);
+        else fputc(*value, f);
+    }
+}
@@ -0,0 +1,272 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Wireless power-saving control over generic netlink, without libnl or iwconfig.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "pwr.h"
+
+#define NL_BUFSIZE 16384
+#define NL_MAX_IFACES 16
+
+// A request message: netlink header, genetlink header, then attributes.
+struct nl_req {
+    struct nlmsghdr n;
+    struct genlmsghdr g;
+    char attrs[256];
+};
+
+static uint32_t seq = 0;
+
+// Kept open between calls, so a long-running pwrd only resolves the family once.
+static int nl_fd = -1;
+static int nl_family = -1;
+
+// Interfaces the last nl80211_set_power_save() changed, and the state each was in before.
+static uint32_t undo_ifaces[NL_MAX_IFACES];
+static uint32_t undo_states[NL_MAX_IFACES];
+static int undo_count = 0;
+
+static int nl_open ();                                            // Open a generic netlink socket.
+static int nl_send (int fd, struct nl_req* req);                  // Send a request, returns its sequence no.
+static int nl_ack (int fd, int sequence);                         // Wait for an ack, returns 0 or -errno.
+static void nl_put (struct nl_req* req, int type, const void* data, int len);
+static void nl_init (struct nl_req* req, int family, int cmd, int flags);
+static struct nlattr* nl_find (void* attrs, int len, int type);   // Find an attribute in a payload.
+
+static int family_id (int fd);                                    // Resolve the nl80211 family id.
+static int station_ifaces (int fd, int family, uint32_t* out, int max);
+static int ps_state (int fd, int family, uint32_t ifindex);      // Current power-save state, or -1.
+// Returns 0, or -errno for the first interface that failed; done counts those that didn't.
+static int set_states (int fd, int family, uint32_t* ifaces, uint32_t* states, int count, int* done);
+
+
+int nl80211_set_power_save (int enabled, int force) {
+    if (nl_fd < 0) {
+        nl_fd = nl_open();
+        if (nl_fd < 0) return -ENOSYS;
+
+        nl_family = family_id(nl_fd);
+        if (nl_family < 0) {
+            close(nl_fd);
+            nl_fd = -1;
+            return -ENOSYS;
+        }
+    }
+
+    int fd = nl_fd, family = nl_family;
+
+    // Interfaces come and go, so they're looked up every time.
+    uint32_t ifaces[NL_MAX_IFACES];
+    int found = station_ifaces(fd, family, ifaces, NL_MAX_IFACES);
+    if (found < 0) return -ENOSYS;
+
+    // Leave out interfaces which are already in the right state, remembering the others' states.
+    uint32_t state = enabled ? NL80211_PS_ENABLED : NL80211_PS_DISABLED;
+    uint32_t states[NL_MAX_IFACES];
+    int count = 0;
+
+    undo_count = 0;
+    for (int i = 0; i < found; i++) {
+        int current = ps_state(fd, family, ifaces[i]);
+        if (!force && current == (int)state) continue;
+
+        if (current >= 0 && current != (int)state) {
+            undo_ifaces[undo_count] = ifaces[i];
+            undo_states[undo_count++] = current;
+        }
+
+        ifaces[count] = ifaces[i];
+        states[count++] = state;
+    }
+
+    int done = 0, error = set_states(fd, family, ifaces, states, count, &done);
+    return error ? error : done;
+}
+
+int nl80211_undo () {
+    int count = undo_count;
+    undo_count = 0;
+    if (count == 0) return 0;
+
+    int done = 0;
+    set_states(nl_fd, nl_family, undo_ifaces, undo_states, count, &done);
+    return count - done;
+}
+
+
+static int nl_open () {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (fd < 0) return -1;
+
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    struct timeval tv = { .tv_sec = 2 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void nl_init (struct nl_req* req, int family, int cmd, int flags) {
+    memset(req, 0, sizeof(*req));
+    req->n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->n.nlmsg_type = family;
+    req->n.nlmsg_flags = NLM_F_REQUEST | flags;
+    req->g.cmd = cmd;
+    req->g.version = 1;
+}
+
+static void nl_put (struct nl_req* req, int type, const void* data, int len) {
+    struct nlattr* a = (struct nlattr*)((char*)&req->n + NLMSG_ALIGN(req->n.nlmsg_len));
+    a->nla_type = type;
+    a->nla_len = NLA_HDRLEN + len;
+    memcpy((char*)a + NLA_HDRLEN, data, len);
+    req->n.nlmsg_len = NLMSG_ALIGN(req->n.nlmsg_len) + NLA_ALIGN(a->nla_len);
+}
+
+static int nl_send (int fd, struct nl_req* req) {
+    req->n.nlmsg_seq = ++seq;
+    if (send(fd, req, req->n.nlmsg_len, 0) < 0) return -1;
+    return req->n.nlmsg_seq;
+}
+
+static int nl_ack (int fd, int sequence) {
+    char buf[NL_BUFSIZE];
+
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) return -errno;
+
+        for (struct nlmsghdr* h = (struct nlmsghdr*)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+            if (h->nlmsg_seq != (uint32_t)sequence || h->nlmsg_type != NLMSG_ERROR) continue;
+            return ((struct nlmsgerr*)NLMSG_DATA(h))->error;
+        }
+    }
+}
+
+static struct nlattr* nl_find (void* attrs, int len, int type) {
+    for (struct nlattr* a = attrs; len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && a->nla_len <= len;
+         len -= NLA_ALIGN(a->nla_len), a = (struct nlattr*)((char*)a + NLA_ALIGN(a->nla_len))) {
+        if ((a->nla_type & NLA_TYPE_MASK) == type) return a;
+    }
+
+    return NULL;
+}
+
+
+static int family_id (int fd) {
+    struct nl_req req;
+    char buf[NL_BUFSIZE];
+
+    nl_init(&req, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0);
+    nl_put(&req, CTRL_ATTR_FAMILY_NAME, NL80211_GENL_NAME, sizeof(NL80211_GENL_NAME));
+    int sequence = nl_send(fd, &req);
+    if (sequence < 0) return -1;
+
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    for (struct nlmsghdr* h = (struct nlmsghdr*)buf; len > 0 && NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+        if (h->nlmsg_seq != (uint32_t)sequence || h->nlmsg_type != GENL_ID_CTRL) continue;
+
+        struct nlattr* id = nl_find((char*)NLMSG_DATA(h) + GENL_HDRLEN,
+            h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), CTRL_ATTR_FAMILY_ID);
+        if (id != NULL) return *(uint16_t*)((char*)id + NLA_HDRLEN);
+    }
+
+    return -1;
+}
+
+static int set_states (int fd, int family, uint32_t* ifaces, uint32_t* states, int count, int* done) {
+    // Queue every request before collecting acks, so it's one round-trip in total.
+    int sequences[NL_MAX_IFACES];
+    struct nl_req req;
+
+    for (int i = 0; i < count; i++) {
+        nl_init(&req, family, NL80211_CMD_SET_POWER_SAVE, NLM_F_ACK);
+        nl_put(&req, NL80211_ATTR_IFINDEX, &ifaces[i], sizeof(uint32_t));
+        nl_put(&req, NL80211_ATTR_PS_STATE, &states[i], sizeof(uint32_t));
+        sequences[i] = nl_send(fd, &req);
+    }
+
+    // Every ack is still collected after a failure, so none is left for the next request to trip on.
+    int first = 0;
+    for (int i = 0; i < count; i++) {
+        int err = sequences[i] < 0 ? -errno : nl_ack(fd, sequences[i]);
+        if (err) fprintf(stderr, "nl80211: ifindex %u: %s\n", ifaces[i], strerror(-err));
+        else (*done)++;
+
+        if (err && !first) first = err;
+    }
+
+    return first;
+}
+
+static int ps_state (int fd, int family, uint32_t ifindex) {
+    struct nl_req req;
+    char buf[NL_BUFSIZE];
+
+    nl_init(&req, family, NL80211_CMD_GET_POWER_SAVE, 0);
+    nl_put(&req, NL80211_ATTR_IFINDEX, &ifindex, sizeof(uint32_t));
+    int sequence = nl_send(fd, &req);
+    if (sequence < 0) return -1;
+
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    for (struct nlmsghdr* h = (struct nlmsghdr*)buf; len > 0 && NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+        if (h->nlmsg_seq != (uint32_t)sequence || h->nlmsg_type != family) continue;
+
+        struct nlattr* ps = nl_find((char*)NLMSG_DATA(h) + GENL_HDRLEN,
+            h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), NL80211_ATTR_PS_STATE);
+        if (ps != NULL) return *(uint32_t*)((char*)ps + NLA_HDRLEN);
+    }
+
+    return -1;
+}
+
+// Collect the ifindex of every managed-mode (station) interface, which is where power-saving applies.
+static int station_ifaces (int fd, int family, uint32_t* out, int max) {
+    struct nl_req req;
+    char buf[NL_BUFSIZE];
+    int count = 0;
+
+    nl_init(&req, family, NL80211_CMD_GET_INTERFACE, NLM_F_DUMP);
+    int sequence = nl_send(fd, &req);
+    if (sequence < 0) return -1;
+
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) return -1;
+
+        for (struct nlmsghdr* h = (struct nlmsghdr*)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+            if (h->nlmsg_seq != (uint32_t)sequence) continue;
+            if (h->nlmsg_type == NLMSG_DONE) return count;
+            if (h->nlmsg_type == NLMSG_ERROR) return -1;
+
+            void* attrs = (char*)NLMSG_DATA(h) + GENL_HDRLEN;
+            int alen = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+            struct nlattr* index = nl_find(attrs, alen, NL80211_ATTR_IFINDEX);
+            struct nlattr* type = nl_find(attrs, alen, NL80211_ATTR_IFTYPE);
+
+            if (index == NULL || count >= max) continue;
+            if (type != NULL && *(uint32_t*)((char*)type + NLA_HDRLEN) != NL80211_IFTYPE_STATION) continue;
+
+            out[count++] = *(uint32_t*)((char*)index + NLA_HDRLEN);
+        }
+    }
+}
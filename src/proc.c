@@ -0,0 +1,118 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Process exec and exit events from the netlink proc connector, so programs can be noticed as
+// they start without polling /proc.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "pwr.h"
+
+
+int proc_open () {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+    if (fd < 0) return -1;
+
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_pid = 0, .nl_groups = CN_IDX_PROC };
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // The kernel only starts sending events once someone asks to listen.
+    char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] __attribute__((aligned(NLMSG_ALIGNTO))) = { 0 };
+    struct nlmsghdr* nl = (struct nlmsghdr*)buf;
+    struct cn_msg* cn = NLMSG_DATA(nl);
+    enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(op));
+    nl->nlmsg_type = NLMSG_DONE;
+    nl->nlmsg_pid = getpid();
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(op);
+    memcpy(cn->data, &op, sizeof(op));
+
+    if (send(fd, buf, nl->nlmsg_len, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int proc_read (int fd, struct proc_change* changes, int max) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int count = 0, lost = 0;
+
+    for (;;) {
+        // ENOBUFS means the kernel dropped events; either way the caller has to look at /proc itself.
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) return errno == EAGAIN && !lost ? count : -1;
+
+        for (struct nlmsghdr* nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, len); nl = NLMSG_NEXT(nl, len)) {
+            struct cn_msg* cn = NLMSG_DATA(nl);
+            struct proc_event* ev = (struct proc_event*)cn->data;
+            if (cn->id.idx != CN_IDX_PROC || (lost |= count == max)) continue;
+
+            // Every thread reports its own exit; only the whole process going away counts.
+            if (ev->what == PROC_EVENT_EXEC)
+                changes[count++] = (struct proc_change){ ev->event_data.exec.process_tgid, 0 };
+            else if (ev->what == PROC_EVENT_EXIT && ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid)
+                changes[count++] = (struct proc_change){ ev->event_data.exit.process_tgid, 1 };
+        }
+    }
+}
+
+int proc_name (pid_t pid, char* out, size_t len) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    return sysfs_read(path, out, len);
+}
+
+int proc_list (pid_t* pids, int max) {
+    int count = 0;
+
+    DIR* d = sysfs_opendir("/proc");
+    if (d == NULL) return 0;
+
+    for (struct dirent* ent; (ent = readdir(d)) != NULL && count < max; ) {
+        char* end;
+        long pid = strtol(ent->d_name, &end, 10);
+        if (*end == 0 && pid > 0) pids[count++] = pid;
+    }
+
+    closedir(d);
+    return count;
+}
+
+int proc_matches (const char* list, const char* name) {
+    char pattern[PROFILE_VALUE_MAX];
+    const char* end;
+
+    // Space- or comma-separated shell patterns, as in pm_allow.
+    for (; *list; list = *end ? end + 1 : end) {
+        end = list + strcspn(list, " ,");
+        if (end == list || end - list >= (long)sizeof(pattern)) continue;
+
+        memcpy(pattern, list, end - list);
+        pattern[end - list] = 0;
+        if (!fnmatch(pattern, name, 0)) return 1;
+    }
+
+    return 0;
+}
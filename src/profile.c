@@ -0,0 +1,303 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Profiles: named sets of knob values, read from PWR_PROFILE_DIR.
+//
+// Each <name>.conf holds "knob = value" lines, with # starting a comment. The parsed table is
+// cached in PWR_PROFILE_CACHE, which stays valid for as long as the directory and every file in
+// it keep the modification times recorded there, so most runs never parse any text.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "pwr.h"
+
+#define CACHE_MAGIC 0x70777270  // "pwrp"
+#define CACHE_VERSION 2
+
+static const char* knob_names[K_COUNT] = {
+    [K_GOVERNOR] = "governor",
+    [K_GPU] = "gpu",
+    [K_WIFI] = "wifi",
+    [K_EPP] = "epp",
+    [K_TURBO] = "turbo",
+    [K_MIN_PERF] = "min_perf_pct",
+    [K_MAX_PERF] = "max_perf_pct",
+    [K_MIN_FREQ] = "min_freq",
+    [K_MAX_FREQ] = "max_freq",
+    [K_PCORES] = "pcores",
+    [K_ECORES] = "ecores",
+    [K_PCORE_MAX_FREQ] = "pcore_max_freq",
+    [K_ECORE_MAX_FREQ] = "ecore_max_freq",
+    [K_PCI_PM] = "pci_pm",
+    [K_USB_PM] = "usb_pm",
+    [K_USB_AUTOSUSPEND] = "usb_autosuspend_ms",
+    [K_SATA_LPM] = "sata_lpm",
+    [K_ASPM] = "aspm",
+    [K_AUDIO_PM] = "audio_power_save",
+    [K_PM_ALLOW] = "pm_allow",
+    [K_PM_DENY] = "pm_deny",
+    [K_BG_SLICE] = "background_slice",
+    [K_BG_CPU_MAX] = "background_cpu_max",
+    [K_BG_CPU_WEIGHT] = "background_cpu_weight",
+    [K_BG_CPUS] = "background_cpus",
+    [K_BG_UCLAMP_MAX] = "background_uclamp_max",
+    [K_FG_SLICE] = "interactive_slice",
+    [K_FG_CPU_MAX] = "interactive_cpu_max",
+    [K_FG_CPU_WEIGHT] = "interactive_cpu_weight",
+    [K_FG_CPUS] = "interactive_cpus",
+    [K_FG_UCLAMP_MAX] = "interactive_uclamp_max",
+    [K_DIRTY_WRITEBACK] = "dirty_writeback_centisecs",
+    [K_DIRTY_EXPIRE] = "dirty_expire_centisecs",
+    [K_LAPTOP_MODE] = "laptop_mode",
+    [K_IO_SCHEDULER] = "io_scheduler",
+    [K_READ_AHEAD] = "read_ahead_kb",
+    [K_NVME_LATENCY] = "nvme_latency_tolerance_us",
+    [K_REFRESH] = "refresh_rate",
+    [K_BACKLIGHT] = "backlight",
+    [K_CHARGE_START] = "charge_start_threshold",
+    [K_CHARGE_END] = "charge_end_threshold",
+    [K_PLATFORM_PROFILE] = "platform_profile",
+    [K_TRIGGERS] = "triggers",
+    [K_BATTERY_BELOW] = "battery_below"
+};
+
+// Always available, though a file of the same name replaces them.
+static const struct profile builtin[] = {
+    { "perform", { [K_GOVERNOR] = "performance", [K_GPU] = "nvidia", [K_WIFI] = "off",
+                   [K_DIRTY_WRITEBACK] = "500", [K_DIRTY_EXPIRE] = "3000", [K_LAPTOP_MODE] = "0" } },
+    { "powersave", { [K_GOVERNOR] = "powersave", [K_GPU] = "intel", [K_WIFI] = "on",
+                     [K_DIRTY_WRITEBACK] = "1500", [K_DIRTY_EXPIRE] = "6000", [K_LAPTOP_MODE] = "5" } }
+};
+
+// Cache file header. It's followed by count mtimes (one per profile, 0 for built-ins) and then
+// count struct profiles.
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t knobs;         // K_COUNT when written, so adding a knob invalidates old caches.
+    uint32_t count;
+    struct timespec dir_mtime;
+};
+
+static struct profile* table = NULL;
+static struct timespec* table_mtimes = NULL;  // Source file mtime of each profile.
+static struct timespec table_dir_mtime;
+static int table_count = 0;
+
+static int table_valid ();                     // Whether the loaded table still matches the files.
+static int load_cache ();
+static void save_cache ();
+static void parse_all ();
+static int parse_file (const char* path, struct profile* p);
+static int add_profile (const struct profile* p, struct timespec mtime);
+static int same_time (struct timespec a, struct timespec b);
+static char* trim (char* s);
+
+
+const char* knob_name (int knob) {
+    return knob_names[knob];
+}
+
+const struct profile* profile_find (const char* name) {
+    int count;
+    profile_all(&count);
+
+    for (int i = 0; i < table_count; i++)
+        if (!strcmp(table[i].name, name)) return &table[i];
+
+    return NULL;
+}
+
+const struct profile* profile_all (int* count) {
+    if (!table_valid() && !load_cache()) {
+        parse_all();
+        save_cache();
+    }
+
+    *count = table_count;
+    return table;
+}
+
+
+static int same_time (struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static int table_valid () {
+    struct stat st;
+    char path[512];
+
+    if (table == NULL) return 0;
+
+    // A missing directory is fine, as long as it was missing when the table was built too.
+    struct timespec dir = { 0, 0 };
+    if (sysfs_stat(PWR_PROFILE_DIR, &st) == 0) dir = st.st_mtim;
+    if (!same_time(dir, table_dir_mtime)) return 0;
+
+    for (int i = 0; i < table_count; i++) {
+        if (table_mtimes[i].tv_sec == 0 && table_mtimes[i].tv_nsec == 0) continue;
+
+        snprintf(path, sizeof(path), "%s/%s.conf", PWR_PROFILE_DIR, table[i].name);
+        if (sysfs_stat(path, &st) < 0 || !same_time(st.st_mtim, table_mtimes[i])) return 0;
+    }
+
+    return 1;
+}
+
+static int load_cache () {
+    struct cache_header header;
+
+    int fd = sysfs_open(PWR_PROFILE_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    int ok = read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == CACHE_MAGIC &&
+             header.version == CACHE_VERSION && header.knobs == K_COUNT && header.count < 4096;
+
+    if (ok) {
+        free(table);
+        free(table_mtimes);
+        table_count = header.count;
+        table_dir_mtime = header.dir_mtime;
+        table = calloc(table_count, sizeof(struct profile));
+        table_mtimes = calloc(table_count, sizeof(struct timespec));
+
+        ssize_t mlen = table_count * sizeof(struct timespec), plen = table_count * sizeof(struct profile);
+        ok = read(fd, table_mtimes, mlen) == mlen && read(fd, table, plen) == plen;
+    }
+
+    close(fd);
+
+    if (!ok || !table_valid()) {
+        free(table);
+        free(table_mtimes);
+        table = NULL;
+        table_mtimes = NULL;
+        table_count = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void save_cache () {
+    char tmp[PATH_MAX], dir[PATH_MAX], buf[PATH_MAX];
+    const char* file = sysfs_path(PWR_PROFILE_CACHE, buf, sizeof(buf));
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+
+    // Only root can write the cache; everyone else just parses each time.
+    mkdir(sysfs_path(PWR_CACHE_DIR, dir, sizeof(dir)), 0755);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    struct cache_header header = { CACHE_MAGIC, CACHE_VERSION, K_COUNT, table_count, table_dir_mtime };
+    ssize_t mlen = table_count * sizeof(struct timespec), plen = table_count * sizeof(struct profile);
+
+    int ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+             write(fd, table_mtimes, mlen) == mlen && write(fd, table, plen) == plen;
+    close(fd);
+
+    if (!ok || rename(tmp, file) < 0) unlink(tmp);
+}
+
+static void parse_all () {
+    struct stat st;
+    char path[512];
+
+    free(table);
+    free(table_mtimes);
+    table = NULL;
+    table_mtimes = NULL;
+    table_count = 0;
+    table_dir_mtime = (struct timespec){ 0, 0 };
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+        add_profile(&builtin[i], (struct timespec){ 0, 0 });
+
+    DIR* dir = sysfs_opendir(PWR_PROFILE_DIR);
+    if (dir == NULL) return;
+    if (fstat(dirfd(dir), &st) == 0) table_dir_mtime = st.st_mtim;
+
+    for (struct dirent* ent; (ent = readdir(dir)) != NULL; ) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 5 || strcmp(ent->d_name + len - 5, ".conf") || len - 5 >= PROFILE_NAME_MAX) continue;
+
+        struct profile p = { 0 };
+        memcpy(p.name, ent->d_name, len - 5);
+
+        snprintf(path, sizeof(path), "%s/%s", PWR_PROFILE_DIR, ent->d_name);
+        if (sysfs_stat(path, &st) < 0 || parse_file(path, &p) < 0) continue;
+
+        add_profile(&p, st.st_mtim);
+    }
+
+    closedir(dir);
+}
+
+static int parse_file (const char* path, struct profile* p) {
+    FILE* f = sysfs_fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), f) != NULL; number++) {
+        line[strcspn(line, "#\n")] = 0;
+
+        char* value = strchr(line, '=');
+        char* key = trim(line);
+        if (value == NULL) {
+            if (*key) fprintf(stderr, "%s:%d: expected 'knob = value'\n", path, number);
+            continue;
+        }
+
+        *value++ = 0;
+        key = trim(key);
+        value = trim(value);
+
+        int knob;
+        for (knob = 0; knob < K_COUNT; knob++)
+            if (!strcmp(key, knob_names[knob])) break;
+
+        if (knob == K_COUNT) fprintf(stderr, "%s:%d: unknown knob '%s'\n", path, number, key);
+        else if (strlen(value) >= PROFILE_VALUE_MAX) fprintf(stderr, "%s:%d: value too long\n", path, number);
+        else strcpy(p->value[knob], value);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int add_profile (const struct profile* p, struct timespec mtime) {
+    // Files take precedence over built-ins of the same name.
+    for (int i = 0; i < table_count; i++) {
+        if (strcmp(table[i].name, p->name)) continue;
+        table[i] = *p;
+        table_mtimes[i] = mtime;
+        return i;
+    }
+
+    table = realloc(table, (table_count + 1) * sizeof(struct profile));
+    table_mtimes = realloc(table_mtimes, (table_count + 1) * sizeof(struct timespec));
+    table[table_count] = *p;
+    table_mtimes[table_count] = mtime;
+    return table_count++;
+}
+
+static char* trim (char* s) {
+    while (isspace((unsigned char)*s)) s++;
+
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = 0;
+
+    return s;
+}
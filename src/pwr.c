@@ -6,28 +6,46 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
 #include <unistd.h>
-#include <glob.h>
-#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 
 #include <config.h>
+#include "pwr.h"
 
-// Run execl() in a new forked process and wait for it to complete.
-#define fexecl(...) \
-    { \
-        int pid, status; \
-        pid = fork(); \
-        ehandle(pid == -1, E_FORK_FAILED); \
-        if (pid == 0) \
-            execl(__VA_ARGS__, (char*)NULL); \
-        else \
-            waitpid(pid, &status, 0); \
-    }
+// Bounds on auto's sampling interval, which backs off while nothing needs to change.
+#define AUTO_MIN_MS 1000
+#define AUTO_MAX_MS 8000
+
+// Limits on per-application triggers: profiles that have them, and processes being followed.
+#define MAX_TRIGGERS 16
+#define MAX_TRIGGERED 256
+
+// How often a scheduled job's cgroup is checked for having gone idle, and how far ahead
+// pwr schedule prints the timeline.
+#define SCHEDULE_SAMPLE_S 5
+#define TIMELINE_S (24 * 3600)
+
+// How often pwrd samples power draw for its metrics, when asked to.
+#define METRICS_INTERVAL_S 15
+#define BATTERY_INTERVAL_S 60
+
+// How many of pwr top's samples each report covers, and how many processes it lists.
+#define TOP_WINDOW 5
+#define TOP_ROWS 15
+
+// How long helper programs get before they're killed. prime-select can rebuild the initramfs,
+// and a display manager can take a while to come back up; everything else should be quick.
+#define HELPER_TIMEOUT_MS 10000
+#define SLOW_HELPER_TIMEOUT_MS 120000
 
 // Handle an error.
 #define ehandle(ACTION, EID) \
@@ -36,159 +54,1556 @@
         exit(EID); \
     }
 
-// Errors to be returned by program - ensures unique error numbers. 
-enum errors {
-    E_OK,
-    E_NO_ACTION,
-    E_BAD_ARG,
-    E_CPUFREQ_WRITE,
-    E_PWR_STATE_WRITE,
-    E_PWR_STATE_READ,
-    E_FORK_FAILED
-};
+// Errors to be returned by program - ensures unique error numbers. 
+enum errors {
+    E_OK,
+    E_NO_ACTION,
+    E_BAD_ARG,
+    E_CPUFREQ_WRITE,
+    E_PWR_STATE_WRITE,
+    E_PWR_STATE_READ,
+    E_FORK_FAILED,
+    E_DAEMON,
+    E_SWITCH_FAILED
+};
+
+// Regular User ID
+static int ruid;
+
+// All cmdline flags after parsing.
+struct s_flags {
+    const char* program_name;  // argv[0]
+    int (*action)();           // Action for program to perform.
+    int no_restart;            // Flag: disables restarting of display manager.
+    int no_wait;               // Flag: don't wait for the display manager restart to finish.
+    int trace;                 // Flag: print timing information to stderr.
+    int force;                 // Flag: apply every setting, even ones that already match.
+    int monitor;               // Flag: pwrd also switches modes on AC power events.
+    int automatic;             // Flag: pwrd also switches modes on load and temperature.
+    int triggers;              // Flag: pwrd also switches to profiles while their programs run.
+    int schedule;              // Flag: pwrd also switches ahead of jobs in the schedule.
+    int debounce_ms;           // How long power events must settle before acting on them.
+    int hysteresis_s;          // Minimum time between automatic switches.
+    double load_high;          // CPU busy % that counts as load, for auto.
+    double load_low;           // CPU busy % that counts as idle.
+    double pressure_high;      // CPU PSI avg10 % that counts as load.
+    double temp_max;           // Temperature that forces powersave.
+    int busy_for;              // Seconds load must last before auto switches to perform.
+    int idle_for;              // Seconds idle must last before it switches to powersave.
+    int metrics;               // Flag: pwrd samples power draw for metrics.
+    const char* textfile;      // Where pwrd keeps a copy of its metrics, or NULL.
+    int hardware;              // Flag: query derives the state from the hardware itself.
+    int watch;                 // Flag: query keeps running, printing each change of state.
+    int quiet;                 // Flag: don't print what changed.
+    int cycles;                // Number of perform/powersave cycles for bench.
+    double seconds;            // How long measure samples for.
+    const char* profile;       // Profile to switch to, for action_profile.
+    const char* root;          // Fake tree to look every system path up in, or NULL.
+};
+
+// The actual parsed go into this struct instance.
+static struct s_flags flags;
+
+// Last known power state, so pwrd doesn't have to reread it.
+static char current_state[16];
+
+// Set by a switch that only takes effect once the display manager restarts.
+static int restart_needed;
+
+// What the switch in progress has changed, so it can be rolled back. Each backend only touches
+// its own part.
+static struct {
+    int cpu[K_COUNT];     // CPU knobs written, in order.
+    int cpu_count;
+    int pm[K_COUNT];      // Device knobs written.
+    int pm_count;
+    int storage[K_COUNT]; // Storage knobs written.
+    int storage_count;
+    int battery[3];       // Battery knobs written.
+    int battery_count;
+    int backlight;        // Whether the backlight was written.
+    int refresh;          // 1 if the mode was committed through DRM, 2 if through the hook.
+    char refresh_hz[16];  // The refresh rate to give the hook to go back.
+    int gpu_offload;      // Whether gpu_runtime_pm() was used.
+    char prime[32];       // The card prime-select switched away from, or "".
+    int wifi;             // Whether nl80211 changed anything.
+    struct sysfs_group* cgroup[2 * CG_COUNT];  // cgroup limits written.
+    int cgroup_count;
+} journal;
+
+// Automatic switching on AC power events.
+struct ac_monitor {
+    int uevents;           // Kernel uevent socket.
+    int timer;             // timerfd for debounce and hysteresis.
+    int applied;           // AC state last switched for, or -1 before the first switch.
+    int level;             // On battery, the battery_below of the tier applied, or 101 for none.
+    struct timespec last;  // When the last automatic switch happened.
+    struct s_flags flags;  // Flags in effect when monitoring started.
+};
+
+static struct ac_monitor monitor;
+
+// Automatic switching on load and temperature.
+struct auto_switch {
+    struct load_meter meter;
+    int timer;             // timerfd for the next sample.
+    long interval_ms;      // Current sampling interval.
+    int standalone;        // Whether other processes might switch modes behind our back.
+    const char* want;      // Mode the recent samples call for, or NULL.
+    struct timespec since; // When they started calling for it.
+    struct timespec last;  // When the last automatic switch happened.
+    int switched;          // Whether there has been one.
+    struct s_flags flags;  // Flags in effect when it started.
+};
+
+static struct auto_switch autosw;
+
+// Switching to profiles while the programs named in their triggers run.
+struct triggers {
+    int events;                      // Proc connector socket.
+    int timer;                       // timerfd for going back once the last program exits.
+    int inotify;                     // Watches the profile directory for new rules.
+    int standalone;                  // Whether other processes might switch modes behind our back.
+    int rules;
+    char profile[MAX_TRIGGERS][PROFILE_NAME_MAX];
+    char patterns[MAX_TRIGGERS][PROFILE_VALUE_MAX];
+    int tracked;                     // Processes running a triggering program, oldest first.
+    pid_t pids[MAX_TRIGGERED];
+    int rule[MAX_TRIGGERED];         // Which rule each one matched.
+    int active;                      // Rule applied now, or -1.
+    char restore[PROFILE_NAME_MAX];  // Profile to go back to afterwards.
+    struct s_flags flags;
+};
+
+static struct triggers trig;
+
+// Switching ahead of the jobs in the schedule, and back once they're done.
+struct scheduler {
+    int timer;                       // CLOCK_REALTIME timerfd for the next switch ahead of a job.
+    int sampler;                     // timerfd for checking whether the job has gone idle.
+    int inotify;                     // Watches the config directory for a new schedule.
+    int standalone;
+    int rules;
+    struct schedule_rule rule[SCHEDULE_MAX];
+    time_t next;                     // When the timer is set for, or 0.
+    int active;                      // Whether a job's profile is applied now.
+    struct schedule_rule current;    // The rule it's for.
+    time_t started;                  // When its job starts, or started.
+    long long usage;                 // The job's CPU time at the last sample, or -1.
+    struct timespec sampled;         // When that was.
+    struct timespec idle_since;      // When the job went idle, or 0.
+    char restore[PROFILE_NAME_MAX];  // Profile to go back to afterwards.
+    struct s_flags flags;
+};
+
+static struct scheduler sched;
+
+// pwrd's power samples for metrics, and where it writes them out.
+static struct energy_meter power_meter;
+static const char* metrics_file;
+
+// The independent parts of a switch, which run concurrently.
+enum backends {
+    B_CPU,
+    B_GPU,
+    B_WIFI,
+    B_PM,
+    B_STORAGE,
+    B_BATTERY,
+    B_DISPLAY,
+    B_CGROUP,
+    B_COUNT
+};
+
+// Parts of a switch that are timed for --trace and bench, after one slot per backend.
+enum timings {
+    T_RESTART_DM = B_COUNT,
+    T_SET_STATE,
+    T_TOTAL,
+    T_COUNT
+};
+
+// How long each part of the last switch took, in microseconds.
+static double timings[T_COUNT];
+
+// One backend's share of a mode switch.
+struct step {
+    int (*run)(const struct profile* p);  // Returns the number of changes made.
+    const struct profile* p;
+    int changed;
+    double usec;                  // How long it took to run.
+};
+
+// Returns true if an executable file exists at the given path.
+static int binary_exists (const char* path);
+
+// Runs a program with one argument and captures the first line of its output.
+static int capture (char* out, size_t len, const char* path, const char* arg);
+
+// Print why a helper program run with spawn_run() failed, if it did. Returns true if it did.
+static int helper_failed (const char* path, int result);
+
+static const char* wlan_name (); // Get wifi interface name.
+static int prime_available ();       // Whether prime-select is there to be used.
+static const char* prime_current (); // Get the currently selected PRIME card, or NULL.
+
+// Each of these only touches hardware that isn't already in the requested state,
+// and returns the number of changes made.
+static void restart_display_manager ();       // Asks systemd to restart display-manager.
+static int prime_select (const char* card);   // Uses prime-select to switch GPUs.
+static int gpu_offload (const char* card);    // Power the discrete GPU up or down for render offload.
+static int wifi_power (const char* state);    // Set wifi power-saving state.
+static int cpu_knob (int knob, const char* value); // Set one CPU knob on every policy.
+
+// Apply a backend's knobs from a profile, skipping any it leaves empty. Each returns the number
+// of changes made, or -1 if something couldn't be changed.
+static int cpu_apply (const struct profile* p);
+static int gpu_apply (const struct profile* p);
+static int wifi_apply (const struct profile* p);
+static int pm_apply (const struct profile* p);
+static int storage_apply_all (const struct profile* p);
+static int battery_apply_all (const struct profile* p);
+static int display_apply (const struct profile* p);
+static int cgroup_apply (const struct profile* p);
+
+// Put back whatever the switch in progress changed through a backend.
+static void cpu_undo ();
+static void gpu_undo ();
+static void wifi_undo ();
+static void pm_undo ();
+static void storage_undo ();
+static void battery_undo ();
+static void display_undo ();
+static void cgroup_undo ();
+
+// Print --trace lines and errors for a group that was just written. Returns the number of errors.
+static int report_group (const char* what, struct sysfs_group* g);
+
+// What applies and undoes each backend, and what it's called in --trace and bench output.
+static const struct {
+    const char* name;
+    int (*apply)(const struct profile* p);
+    void (*undo)();
+} backends[B_COUNT] = {
+    [B_CPU] = { "cpu", cpu_apply, cpu_undo },
+    [B_GPU] = { "gpu", gpu_apply, gpu_undo },
+    [B_WIFI] = { "wifi_power", wifi_apply, wifi_undo },
+    [B_PM] = { "device_pm", pm_apply, pm_undo },
+    [B_STORAGE] = { "storage", storage_apply_all, storage_undo },
+    [B_BATTERY] = { "battery", battery_apply_all, battery_undo },
+    [B_DISPLAY] = { "display", display_apply, display_undo },
+    [B_CGROUP] = { "cgroup", cgroup_apply, cgroup_undo }
+};
+
+static double usec_since (const struct timespec* start); // Microseconds elapsed on CLOCK_MONOTONIC.
+static const char* timing_name (int timing);
+static void run_steps (struct step* steps, int count); // Run steps concurrently, waiting for all of them.
+static void* step_thread (void* arg);
+static int apply_profile (const struct profile* p); // Switch to a profile and record it as the state.
+static void rollback ();                            // Undo a switch that didn't fully go through.
+
+static int monitor_start ();                      // Start watching for AC power events.
+static void monitor_arm (long ms);                // (Re)start the monitor's timer.
+static void monitor_uevent (int fd);   // A uevent arrived.
+static void monitor_timer (int fd);    // Events have settled; switch if needed.
+static void hotplug_uevent (int fd);   // Devices may have come or gone.
+static const struct profile* monitor_tier (int capacity, int* level); // The tier for a charge, or NULL.
+static int battery_start ();                      // Start sampling the battery for its rate.
+static void battery_timer (int fd);    // Take a battery sample.
+
+static int auto_start (int standalone);           // Start sampling load and temperature.
+static void auto_arm ();                          // Schedule the next sample.
+static void auto_timer (int fd);       // Take a sample; switch if it's time to.
+static const char* auto_wants (const struct load_sample* s); // The mode a sample calls for, or NULL.
+static long ms_between (const struct timespec* a, const struct timespec* b);
+
+static int triggers_start (int standalone);       // Start following programs named in triggers.
+static void triggers_load ();                     // Read the rules and look for running programs.
+static void triggers_event (int fd);   // Processes started or exited.
+static void triggers_reload (int fd);  // The profile directory changed.
+static void triggers_timer (int fd);   // The grace period after the last exit is over.
+static void triggers_exec (pid_t pid);            // Follow a process if its program has a trigger.
+static void triggers_forget (pid_t pid);          // Stop following a process.
+static void triggers_update ();                   // Switch to whichever profile is wanted now.
+static void triggers_switch (const char* profile);
+
+static int schedule_start (int standalone);       // Start switching ahead of scheduled jobs.
+static void schedule_plan ();                     // Arm the timer for the next switch.
+static void schedule_timer (int fd);   // A job is about to start, or the clock changed.
+static void schedule_sample (int fd);  // Check whether the job is done.
+static void schedule_reload (int fd);  // The config directory changed.
+static void schedule_switch (const char* profile);
+static void record_switch (const struct profile* p, int ok); // Add a switch to the metrics.
+static int metrics_start ();                       // Start sampling power draw for metrics.
+static void metrics_timer (int fd);    // Take a power sample.
+
+static const char* get_pwr_state ();           // Get the power state info.
+static const char* hardware_state ();          // Work out the power state from the hardware.
+static const char* matching_profile (const char* governor, const char* card);  // Or "unknown".
+static int set_pwr_state (const char* state);  // Save the power state info. Returns 0 or -1.
+
+// Actions that may be performed by the program, depending on flags given.
+static int action_none ();       // No action specified, print error and exit.
+static int action_perform ();    // Enable performance mode.
+static int action_powersave ();  // Enable power-saving mode.
+static int action_profile ();    // Switch to the profile named in flags.
+static int action_query ();      // Print the current state.
+static int action_toggle ();     // Switch to whichever mode we're not in.
+static int action_daemon ();     // Serve requests on the pwrd socket.
+static int action_monitor ();    // Switch modes on AC power events.
+static int action_auto ();       // Switch modes on load and temperature.
+static int action_triggers ();   // Switch profiles while the programs in their triggers run.
+static int action_schedule ();   // Print the schedule's timeline, or follow it.
+static int action_bench ();      // Time repeated switches.
+static int action_measure ();    // Report average power draw in the current mode.
+static int action_top ();        // Show where the CPUs spend their time, live.
+static int action_metrics ();    // Print pwrd's metrics for Prometheus.
+static int action_battery ();    // Print the battery's discharge rate and time to empty.
+static int action_version ();    // Print version information.
+static int action_help ();       // Print help information.
+
+static int parse_args (int argc, char** argv); // Parse cmdline args and set appropriate flags.
+
+static int remote_action (); // Returns true if the chosen action can be handed to pwrd.
+static int serve_request (int argc, char** argv); // Handle one request sent to pwrd.
+
+
+int main (int argc, char** argv) {
+    // Only switching modes needs root; everything else runs as the real user.
+    ruid = getuid();
+    seteuid(ruid);
+
+    int result = parse_args(argc, argv);
+    if (result != E_OK) return result;
+
+    // Whatever is in a fake tree is the caller's, so it's only ever touched as the caller.
+    if (flags.root != NULL) {
+        seteuid(0);
+        ehandle(setuid(ruid) < 0, E_BAD_ARG);
+        sysfs_set_root(flags.root);
+    }
+
+    // A running pwrd has everything discovered and open already, so let it do the work.
+    // Queries are cheaper to answer locally than to send over a socket.
+    if (remote_action() && flags.action != action_query) {
+        char socket[PATH_MAX];
+        result = daemon_request(sysfs_path(PWR_SOCKET, socket, sizeof(socket)), argc - 1, argv + 1);
+        if (result >= 0) return result;
+    }
+
+    result = flags.action();
+
+    // Whatever this run had to discover, the next one won't.
+    seteuid(0);
+    caps_save();
+    seteuid(ruid);
+    return result;
+}
+
+
+static int binary_exists (const char* path) {
+    char key[128];
+    snprintf(key, sizeof(key), "bin.%s", path);
+
+    char known[8];
+    if (caps_get(key, known, sizeof(known))) return known[0] == '1';
+
+    struct stat status;
+    int found = sysfs_stat(path, &status) == 0 && (status.st_mode & S_IEXEC) != 0;
+    caps_set(key, found ? "1" : "0");
+    return found;
+}
+
+static int capture (char* out, size_t len, const char* path, const char* arg) {
+    int result = spawn_run(path, (const char* const[]){ path, arg, NULL }, HELPER_TIMEOUT_MS, out, len);
+
+    out[strcspn(out, "\n")] = 0;
+    return helper_failed(path, result) ? -1 : 0;
+}
+
+static int helper_failed (const char* path, int result) {
+    if (result == 0) return 0;
+
+    if (result == SPAWN_FAILED) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    else if (result == SPAWN_TIMEOUT) fprintf(stderr, "%s: still running after its timeout, killed\n", path);
+    else if (result > 128) fprintf(stderr, "%s: killed by signal %d\n", path, result - 128);
+    else fprintf(stderr, "%s: exited with status %d\n", path, result);
+    return 1;
+}
+
+static const char* wlan_name () {
+    char known[CAPS_VALUE_MAX];
+    if (caps_get("net.wlan", known, sizeof(known))) return known[0] ? strdup(known) : NULL;
+
+    // Every interface, up or not, has a directory here, and a fake tree can have its own.
+    glob_t results = { 0 };
+    char* ifname = NULL;
+    if (sysfs_glob("/sys/class/net/wl*", 0, NULL, &results) == 0)
+        ifname = strdup(strrchr(results.gl_pathv[0], '/') + 1);
+
+    globfree(&results);
+    caps_set("net.wlan", ifname ? ifname : "");
+    return ifname;
+}
+
+
+static void restart_display_manager () {
+    if (flags.no_restart) return;
+
+#if PWR_WITH_SDBUS
+    // Only fall back to forking systemctl if the system bus can't be reached. The bus is the
+    // real system's, never a fake tree's.
+    if (!sysfs_root()[0] && dbus_restart_unit("display-manager.service", !flags.no_wait) >= 0) return;
+#endif
+
+    if (binary_exists("/bin/systemctl")) {
+        if (flags.no_wait) {
+            helper_failed("/bin/systemctl", spawn_wait("/bin/systemctl", HELPER_TIMEOUT_MS,
+                          "systemctl", "--no-block", "restart", "display-manager"));
+        } else {
+            helper_failed("/bin/systemctl", spawn_wait("/bin/systemctl", SLOW_HELPER_TIMEOUT_MS,
+                          "systemctl", "restart", "display-manager"));
+        }
+    }
+}
+
+static int prime_available () {
+#if PWR_WITH_PRIME
+    return binary_exists("/usr/bin/prime-select");
+#else
+    return 0;
+#endif
+}
+
+static const char* prime_current () {
+    static char card[32];
+
+    // nvidia-prime keeps its selection here, which saves forking prime-select just to ask.
+    FILE* f = sysfs_fopen("/etc/prime-discrete", "r");
+    if (f != NULL) {
+        char line[32] = "";
+        fgets(line, sizeof(line), f);
+        fclose(f);
+        line[strcspn(line, "\n")] = 0;
+
+        if (!strcmp(line, "on")) return "nvidia";
+        if (!strcmp(line, "off")) return "intel";
+        if (!strcmp(line, "on-demand")) return "on-demand";
+    }
+
+    if (capture(card, sizeof(card), "/usr/bin/prime-select", "query") < 0) return NULL;
+    return card;
+}
+
+static int prime_select (const char* card) {
+    if (!prime_available()) return 0;
+
+    const char* current = flags.force ? NULL : prime_current();
+    if (current != NULL && !strcmp(current, card)) return 0;
+
+    if (helper_failed("/usr/bin/prime-select", spawn_wait("/usr/bin/prime-select", SLOW_HELPER_TIMEOUT_MS, "prime-select", card)))
+        return -1;
+
+    if (!flags.quiet) printf("GPU: %s -> %s\n", current ? current : "unknown", card);
+    if (current != NULL) snprintf(journal.prime, sizeof(journal.prime), "%s", current);
+    restart_needed = 1;
+    return 1;
+}
+
+static int gpu_offload (const char* card) {
+    // With only the integrated GPU wanted, runtime PM on every function lets the whole card power
+    // off. With the discrete GPU wanted, it stays powered, so offloaded rendering never waits
+    // for it to wake.
+    int all = !strcmp(card, "intel");
+    int changed = gpu_runtime_pm(all ? "auto" : "on", all, flags.force);
+
+    // A failure can still have got through on some functions, which rollback then puts back.
+    journal.gpu_offload = changed != 0;
+    if (changed <= 0) return changed;
+
+    const char* status = gpu_runtime_status();
+    if (!flags.quiet)
+        printf("GPU: %s runtime PM %s, now %s\n", all ? "slot" : "dGPU", all ? "on" : "off", status ? status : "unknown");
+    return changed;
+}
+
+static int wifi_power (const char* state) {
+    int changed = -ENOSYS;
+
+#if PWR_WITH_NL80211
+    // nl80211 covers every wireless interface at once; iwconfig is only for kernels without it.
+    // Like D-Bus, netlink only reaches the real system.
+    if (!sysfs_root()[0]) changed = nl80211_set_power_save(!strcmp(state, "on"), flags.force);
+
+    // Interfaces that did change before one failed still need putting back.
+    journal.wifi = changed != -ENOSYS;
+    if (changed < 0 && changed != -ENOSYS) return -1;
+#endif
+
+    if (changed == -ENOSYS) {
+        changed = 0;
+
+#if PWR_WITH_IWCONFIG
+        // There's no cheap way to ask iwconfig for the current state, so always set it.
+        const char* iface = wlan_name();
+        if (binary_exists("/sbin/iwconfig") && iface != NULL) {
+            int result = spawn_wait("/sbin/iwconfig", HELPER_TIMEOUT_MS, "iwconfig", iface, "power", state);
+            changed = helper_failed("/sbin/iwconfig", result) ? -1 : 1;
+        }
+
+        free((void*)iface);
+#endif
+    }
+
+    if (changed > 0 && !flags.quiet) printf("Wi-Fi power saving: %s on %d interface(s)\n", state, changed);
+    return changed;
+}
+
+static int cpu_knob (int knob, const char* value) {
+    struct sysfs_group* g = cpu_files(knob);
+
+    if (g == NULL) {
+        if (!flags.quiet) fprintf(stderr, "CPU %s: not supported by %s\n", knob_name(knob),
+            cpu_driver()[0] ? cpu_driver() : "this system");
+        return 0;
+    }
+
+    journal.cpu[journal.cpu_count++] = knob;
+    sysfs_group_write(g, cpu_value(knob, value), PWR_MAX_THREADS, flags.force);
+    int changed = 0, failed = 0, error = 0;
+    char current[32];
+
+    for (int i = 0; i < g->count; i++) {
+        if (flags.trace)
+            fprintf(stderr, "trace: %s: %.1f us%s\n", g->paths[i], g->usec[i], g->changed[i] ? "" : " (unchanged)");
+
+        // A policy whose CPUs are all offline refuses even reads, and keeps its settings for when
+        // they come back, so it isn't a failure.
+        if (g->errors[i] == EBUSY && sysfs_read(g->paths[i], current, sizeof(current)) < 0 && errno == EBUSY)
+            continue;
+
+        // Kept aside, as the probe above overwrites errno for the policies after it.
+        if (g->errors[i]) {
+            if (!failed++) error = g->errors[i];
+        } else changed += g->changed[i];
+    }
+
+    if (failed) fprintf(stderr, "CPU %s: %s: %s\n", knob_name(knob), value, strerror(error));
+
+    // intel_pstate pins EPP to performance under the performance governor. That's a mistake in
+    // the profile rather than a half-finished switch, so it's only a warning.
+    if (failed && knob == K_EPP && error == EBUSY) {
+        fprintf(stderr, "CPU epp: set a different governor first\n");
+        failed = 0;
+    }
+
+    if (changed && !flags.quiet) printf("CPU %s: %s on %d of %d\n", knob_name(knob), value, changed, g->count);
+    return failed ? -1 : changed;
+}
+
+static int cpu_apply (const struct profile* p) {
+    // Cores come online first, so that everything after applies to them too, and go offline last.
+    // The governor comes next, since intel_pstate decides which EPP values are allowed from it.
+    static const int order[] = {
+        K_PCORES, K_ECORES, K_GOVERNOR, K_EPP, K_MIN_PERF, K_MAX_PERF, K_MIN_FREQ, K_MAX_FREQ,
+        K_PCORE_MAX_FREQ, K_ECORE_MAX_FREQ, K_TURBO, K_PCORES, K_ECORES
+    };
+    int changed = 0, count = sizeof(order) / sizeof(order[0]);
+
+    for (int i = 0; i < count; i++) {
+        int k = order[i];
+        if (!p->value[k][0]) continue;
+
+        // The core knobs come up twice: first to bring cores online, then to take them offline.
+        int online = strcmp(p->value[k], "off");
+        if ((k == K_PCORES || k == K_ECORES) && online != (i < 2)) continue;
+
+        // Keep each min/max pair in order while it's being changed, or the kernel rejects one.
+        int done;
+        if ((k == K_MIN_PERF || k == K_MIN_FREQ) && p->value[k + 1][0] && cpu_max_first(k, p->value[k])) {
+            if ((done = cpu_knob(k + 1, p->value[k + 1])) < 0) return -1;
+            changed += done;
+            i++;
+        }
+
+        if ((done = cpu_knob(k, p->value[k])) < 0) return -1;
+        changed += done;
+    }
+
+    return changed;
+}
+
+static int gpu_apply (const struct profile* p) {
+    const char* card = p->value[K_GPU];
+    if (!card[0]) return 0;
+
+    // prime-select's fixed modes need a new session, but on-demand (or no nvidia-prime at all)
+    // means offload, where the discrete GPU can simply be powered up and down.
+    const char* current = prime_available() ? prime_current() : NULL;
+    int offload = gpu_discrete() != NULL && (current == NULL || !strcmp(current, "on-demand"));
+
+    return offload && strcmp(card, "on-demand") ? gpu_offload(card) : prime_select(card);
+}
+
+static int wifi_apply (const struct profile* p) {
+    return p->value[K_WIFI][0] ? wifi_power(p->value[K_WIFI]) : 0;
+}
+
+static int pm_apply (const struct profile* p) {
+    static const int knobs[] = { K_PCI_PM, K_USB_PM, K_USB_AUTOSUSPEND, K_SATA_LPM, K_ASPM, K_AUDIO_PM };
+    int changed = 0;
+
+    for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+        int k = knobs[i];
+        if (!p->value[k][0]) continue;
+
+        int done = devices_apply(k, p->value[k], p->value[K_PM_ALLOW], p->value[K_PM_DENY], flags.force);
+        struct sysfs_group* g = device_files(k);
+
+        if (done < 0) {
+            if (!flags.quiet) fprintf(stderr, "%s: no devices\n", knob_name(k));
+            continue;
+        }
+
+        journal.pm[journal.pm_count++] = k;
+        int failed = report_group(knob_name(k), g);
+
+        if (done && !flags.quiet) printf("Devices %s: %s on %d of %d\n", knob_name(k), p->value[k], done, g->count);
+        if (failed) return -1;
+        changed += done;
+    }
+
+    return changed;
+}
+
+static int storage_apply_all (const struct profile* p) {
+    static const int knobs[] = { K_DIRTY_WRITEBACK, K_DIRTY_EXPIRE, K_LAPTOP_MODE, K_IO_SCHEDULER, K_READ_AHEAD, K_NVME_LATENCY };
+    int changed = 0;
+
+    for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+        int k = knobs[i];
+        if (!p->value[k][0]) continue;
+
+        int done = storage_apply(k, p->value[k], flags.force);
+        struct sysfs_group* g = storage_files(k);
+
+        if (done < 0) {
+            if (!flags.quiet) fprintf(stderr, "%s: not supported by this system\n", knob_name(k));
+            continue;
+        }
+
+        journal.storage[journal.storage_count++] = k;
+        int failed = report_group(knob_name(k), g);
+
+        if (done && !flags.quiet) printf("Storage %s: %s\n", knob_name(k), p->value[k]);
+        if (failed) return -1;
+        changed += done;
+    }
+
+    return changed;
+}
+
+static int display_apply (const struct profile* p) {
+    const char* rate = p->value[K_REFRESH];
+    const char* brightness = p->value[K_BACKLIGHT];
+    int changed = 0;
+
+    if (brightness[0]) {
+        struct sysfs_group* g = backlight_files();
+        if (g == NULL) {
+            if (!flags.quiet) fprintf(stderr, "backlight: no backlight found\n");
+        } else {
+            sysfs_group_write(g, backlight_value(brightness), 1, flags.force);
+            journal.backlight = 1;
+            if (report_group("backlight", g)) return -1;
+            changed += g->changed[0];
+        }
+    }
+
+    if (!rate[0]) return changed;
+
+    int hz = display_refresh();
+    int result = display_set_refresh(rate, flags.force);
+
+    // The compositor owns the display; the hook asks it to switch, through whatever it speaks.
+    if (result == -2 && binary_exists(PWR_DISPLAY_HOOK)) {
+        int failed = helper_failed(PWR_DISPLAY_HOOK, spawn_wait(PWR_DISPLAY_HOOK, HELPER_TIMEOUT_MS,
+                                   "display-hook", display_panel(), rate));
+        if (failed) return -1;
+
+        if (hz > 0) snprintf(journal.refresh_hz, sizeof(journal.refresh_hz), "%d", hz);
+        journal.refresh = 2;
+        result = 1;
+    }
+
+    if (result == -2) {
+        fprintf(stderr, "refresh_rate: the compositor is DRM master and there's no %s\n", PWR_DISPLAY_HOOK);
+        return -1;
+    } else if (result == -1) {
+        if (display_panel() != NULL) fprintf(stderr, "refresh_rate: %s: %s\n", display_panel(), strerror(errno));
+        else if (!flags.quiet) fprintf(stderr, "refresh_rate: no internal panel found\n");
+        return display_panel() != NULL ? -1 : changed;
+    }
+
+    if (result == 1 && journal.refresh == 0) journal.refresh = 1;
+    if (result == 1 && !flags.quiet) printf("Display %s: %d Hz -> %s\n", display_panel(), hz, rate);
+    return changed + result;
+}
+
+static int cgroup_apply (const struct profile* p) {
+    static const int slices[] = { K_BG_SLICE, K_FG_SLICE };
+    char cpus[256];
+    int changed = 0;
+
+    for (size_t i = 0; i < sizeof(slices) / sizeof(slices[0]); i++) {
+        const char* slice = p->value[slices[i]];
+        if (!slice[0]) continue;
+
+        for (int a = 0; a < CG_COUNT; a++) {
+            const char* value = p->value[slices[i] + 1 + a];
+            if (!value[0]) continue;
+
+            // Core types are easier to name than to list, and the list depends on the machine.
+            if (a == CG_CPUSET && (!strcmp(value, "pcores") || !strcmp(value, "ecores"))) {
+                if (cpu_core_list(value[0] == 'p', cpus, sizeof(cpus)) < 0) {
+                    if (!flags.quiet) fprintf(stderr, "%s: not a hybrid CPU, leaving %s alone\n", slice, value);
+                    continue;
+                }
+                value = cpus;
+            }
+
+            struct sysfs_group* g = cgroup_files(slice, a);
+            if (g == NULL) {
+                if (!flags.quiet)
+                    fprintf(stderr, "%s: no %s; the %s controller isn't enabled for it\n",
+                        slice, cgroup_attr_name(a), cgroup_controller(a));
+                continue;
+            }
+
+            journal.cgroup[journal.cgroup_count++] = g;
+            sysfs_group_write(g, value, PWR_MAX_THREADS, flags.force);
+            if (report_group(cgroup_attr_name(a), g)) return -1;
+
+            int done = 0;
+            for (int j = 0; j < g->count; j++)
+                done += g->changed[j];
+
+            if (done && !flags.quiet) printf("%s %s: %s\n", slice, cgroup_attr_name(a), value);
+            changed += done;
+        }
+    }
+
+    return changed;
+}
+
+static int report_group (const char* what, struct sysfs_group* g) {
+    int failed = 0;
+
+    for (int i = 0; i < g->count; i++) {
+        if (g->skip[i]) continue;
+        if (flags.trace)
+            fprintf(stderr, "trace: %s: %.1f us%s\n", g->paths[i], g->usec[i], g->changed[i] ? "" : " (unchanged)");
+        if (g->errors[i]) fprintf(stderr, "%s: %s: %s\n", what, g->paths[i], strerror(g->errors[i]));
+        failed += g->errors[i] != 0;
+    }
+
+    return failed;
+}
+
+static void cpu_undo () {
+    // Newest first, so that e.g. offlined cores are back online before their limits are restored.
+    for (int i = journal.cpu_count - 1; i >= 0; i--)
+        if (sysfs_group_undo(cpu_files(journal.cpu[i])))
+            fprintf(stderr, "CPU %s: couldn't restore every value\n", knob_name(journal.cpu[i]));
+}
+
+static void gpu_undo () {
+    if (journal.gpu_offload && gpu_runtime_pm_undo()) fprintf(stderr, "GPU: couldn't restore runtime PM\n");
+
+    // Switching back is as slow as switching was, but it's the only way to undo it.
+    if (journal.prime[0]) {
+        helper_failed("/usr/bin/prime-select", spawn_wait("/usr/bin/prime-select", SLOW_HELPER_TIMEOUT_MS,
+                      "prime-select", journal.prime));
+        restart_needed = 0;
+    }
+}
+
+static int battery_apply_all (const struct profile* p) {
+    int knobs[] = { K_CHARGE_START, K_CHARGE_END, K_PLATFORM_PROFILE };
+    int changed = 0;
+
+    if (p->value[K_CHARGE_START][0] && p->value[K_CHARGE_END][0] && battery_end_first(p->value[K_CHARGE_START])) {
+        knobs[0] = K_CHARGE_END;
+        knobs[1] = K_CHARGE_START;
+    }
+
+    for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+        int k = knobs[i];
+        if (!p->value[k][0]) continue;
+
+        int done = battery_apply(k, p->value[k], flags.force);
+        if (done == -2) {
+            fprintf(stderr, "%s: %s isn't one of %s\n", knob_name(k), p->value[k], battery_profiles());
+            return -1;
+        }
+
+        if (done < 0) {
+            if (!flags.quiet) fprintf(stderr, "%s: not supported by this system\n", knob_name(k));
+            continue;
+        }
+
+        journal.battery[journal.battery_count++] = k;
+        int failed = report_group(knob_name(k), battery_files(k));
+
+        if (done && !flags.quiet) printf("Battery %s: %s\n", knob_name(k), p->value[k]);
+        if (failed) return -1;
+        changed += done;
+    }
+
+    return changed;
+}
+
+static void wifi_undo () {
+#if PWR_WITH_NL80211
+    if (journal.wifi && nl80211_undo()) fprintf(stderr, "Wi-Fi: couldn't restore power saving\n");
+#endif
+}
+
+static void pm_undo () {
+    for (int i = journal.pm_count - 1; i >= 0; i--)
+        if (sysfs_group_undo(device_files(journal.pm[i])))
+            fprintf(stderr, "%s: couldn't restore every device\n", knob_name(journal.pm[i]));
+}
+
+static void battery_undo () {
+    for (int i = journal.battery_count - 1; i >= 0; i--)
+        if (sysfs_group_undo(battery_files(journal.battery[i])))
+            fprintf(stderr, "%s: couldn't restore every battery\n", knob_name(journal.battery[i]));
+}
+
+static void storage_undo () {
+    for (int i = journal.storage_count - 1; i >= 0; i--)
+        if (sysfs_group_undo(storage_files(journal.storage[i])))
+            fprintf(stderr, "%s: couldn't restore every value\n", knob_name(journal.storage[i]));
+}
+
+static void display_undo () {
+    if (journal.backlight && sysfs_group_undo(backlight_files())) fprintf(stderr, "backlight: couldn't restore it\n");
+
+    if (journal.refresh == 1 && display_refresh_undo()) fprintf(stderr, "refresh_rate: couldn't restore the mode\n");
+    if (journal.refresh == 2 && journal.refresh_hz[0])
+        helper_failed(PWR_DISPLAY_HOOK, spawn_wait(PWR_DISPLAY_HOOK, HELPER_TIMEOUT_MS,
+                      "display-hook", display_panel(), journal.refresh_hz));
+}
+
+static void cgroup_undo () {
+    for (int i = journal.cgroup_count - 1; i >= 0; i--)
+        if (sysfs_group_undo(journal.cgroup[i]))
+            fprintf(stderr, "cgroup: couldn't restore %s\n", journal.cgroup[i]->paths[0]);
+}
+
+
+static double usec_since (const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static const char* timing_name (int timing) {
+    static const char* extra[] = { "restart_display_manager", "set_pwr_state", "total" };
+    return timing < B_COUNT ? backends[timing].name : extra[timing - B_COUNT];
+}
+
+static void run_steps (struct step* steps, int count) {
+    pthread_t threads[count];
+    int started[count];
+
+    // Each step mostly waits on the kernel or a helper process, so there's no point serialising them.
+    for (int i = 0; i < count; i++)
+        started[i] = pthread_create(&threads[i], NULL, step_thread, &steps[i]) == 0;
+
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else step_thread(&steps[i]);
+    }
+}
+
+static void* step_thread (void* arg) {
+    struct step* step = arg;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    step->changed = step->run(step->p);
+    step->usec = usec_since(&start);
+    return NULL;
+}
+
+static int apply_profile (const struct profile* p) {
+    struct step steps[B_COUNT];
+    int changed = 0, result = E_OK;
+    struct timespec start, part;
+
+    restart_needed = 0;
+    memset(&journal, 0, sizeof(journal));
+    for (int b = 0; b < B_COUNT; b++)
+        steps[b] = (struct step){ backends[b].apply, p, 0, 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Without setuid, the sysfs writes and the state file go through pwr-helper instead.
+    if (seteuid(0) < 0 && !sysfs_root()[0]) sysfs_use_helper(PWR_HELPER);
+    run_steps(steps, B_COUNT);
+
+    memset(timings, 0, sizeof(timings));
+    for (int b = 0; b < B_COUNT; b++) {
+        timings[b] = steps[b].usec;
+        if (steps[b].changed < 0) result = E_SWITCH_FAILED;
+        else changed += steps[b].changed;
+    }
+
+    // The new state is only recorded once everything else has gone through.
+    clock_gettime(CLOCK_MONOTONIC, &part);
+    if (result == E_OK && set_pwr_state(p->name) < 0) {
+        fprintf(stderr, "Couldn't save the state to %s: %s\n", STATE_FILE, strerror(errno));
+        result = E_PWR_STATE_WRITE;
+    }
+    timings[T_SET_STATE] = usec_since(&part);
+
+    if (result != E_OK) {
+        rollback();
+        sysfs_helper_close();
+        seteuid(ruid);
+        timings[T_TOTAL] = usec_since(&start);
+        record_switch(p, 0);
+        fprintf(stderr, "Switch to %s failed; previous settings restored.\n", p->name);
+        return result;
+    }
+
+    // Only a GPU switch needs the session restarted to take effect.
+    clock_gettime(CLOCK_MONOTONIC, &part);
+    if (restart_needed) restart_display_manager();
+    timings[T_RESTART_DM] = usec_since(&part);
+
+    if (!changed && !flags.quiet)
+        printf("Already in %s mode.\n", p->name);
+
+    caps_save();
+    sysfs_helper_close();
+    seteuid(ruid);
+    timings[T_TOTAL] = usec_since(&start);
+    record_switch(p, 1);
+
+    if (flags.trace)
+        for (int i = 0; i < T_COUNT; i++)
+            fprintf(stderr, "trace: %s: %.1f us\n", timing_name(i), timings[i]);
+
+    return E_OK;
+}
+
+static void record_switch (const struct profile* p, int ok) {
+    metrics_switch(p->name, ok);
+
+    // Most switches don't restart anything, and shouldn't drag that histogram down to zero.
+    for (int i = 0; i < T_COUNT; i++)
+        if (i != T_RESTART_DM || restart_needed) metrics_step(timing_name(i), timings[i]);
+
+    if (metrics_file != NULL && metrics_save(metrics_file, get_pwr_state()) < 0)
+        fprintf(stderr, "Couldn't write metrics to %s: %s\n", metrics_file, strerror(errno));
+}
+
+static void rollback () {
+    // Each undo only writes back what was saved, once, so this can't take longer than the switch.
+    for (int b = B_COUNT - 1; b >= 0; b--)
+        backends[b].undo();
+}
+
+
+static int monitor_start () {
+    monitor.uevents = uevent_open();
+    monitor.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    monitor.applied = -1;
+    monitor.level = 101;
+    monitor.flags = flags;
+
+    if (monitor.uevents < 0 || monitor.timer < 0) return -1;
+    if (daemon_watch(monitor.uevents, monitor_uevent) < 0) return -1;
+    if (daemon_watch(monitor.timer, monitor_timer) < 0) return -1;
+    battery_start();
+
+    // Bring the mode in line with the current AC state straight away.
+    monitor_arm(0);
+    return 0;
+}
+
+static void monitor_arm (long ms) {
+    struct itimerspec when = { { 0, 0 }, { ms / 1000, (ms % 1000) * 1000000 } };
+
+    // A zero it_value would disarm the timer instead.
+    if (ms <= 0) when.it_value.tv_nsec = 1;
+    timerfd_settime(monitor.timer, 0, &when, NULL);
+}
+
+static void monitor_uevent (int fd) {
+    // Plugging in fires several events in a row (adapter, battery, USB-C), so wait for quiet.
+    static const char* const power[] = { "power_supply", NULL };
+    if (uevent_read(fd, power)) monitor_arm(monitor.flags.debounce_ms);
+}
+
+static void monitor_timer (int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+
+    int online = ac_online(), level = 101;
+    if (online < 0) return;
+
+    // On battery, step down through the tiers as charge runs out, but never back up until AC
+    // returns; charge readings wobble by a percent either way.
+    const struct profile* tier = online ? NULL : monitor_tier(battery_capacity(), &level);
+    if (online == monitor.applied && (online || level >= monitor.level)) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Too soon after the last switch: look again once the hysteresis window is over.
+    long since = (now.tv_sec - monitor.last.tv_sec) * 1000 + (now.tv_nsec - monitor.last.tv_nsec) / 1000000;
+    if (monitor.applied >= 0 && since < monitor.flags.hysteresis_s * 1000L) {
+        monitor_arm(monitor.flags.hysteresis_s * 1000L - since);
+        return;
+    }
+
+    flags = monitor.flags;
+    flags.profile = tier ? tier->name : NULL;
+    if (online) action_perform();
+    else if (tier) action_profile();
+    else action_powersave();
+    fflush(stdout);
+
+    monitor.applied = online;
+    monitor.level = level;
+    monitor.last = now;
+}
+
+static const struct profile* monitor_tier (int capacity, int* level) {
+    const struct profile* tier = NULL;
+    int count;
+
+    *level = 101;
+    if (capacity < 0) return NULL;
+
+    // The lowest level that charge has fallen below is the most aggressive tier that applies.
+    const struct profile* all = profile_all(&count);
+    for (int i = 0; i < count; i++) {
+        int below = all[i].value[K_BATTERY_BELOW][0] ? atoi(all[i].value[K_BATTERY_BELOW]) : 0;
+        if (below > 0 && capacity < below && below < *level) {
+            *level = below;
+            tier = &all[i];
+        }
+    }
+
+    return tier;
+}
+
+static int battery_start () {
+    static int timer = -1;
+    struct itimerspec every = { { BATTERY_INTERVAL_S, 0 }, { BATTERY_INTERVAL_S, 0 } };
+    struct battery_reading r;
+
+    // Both the daemon and its monitor want it, but once is enough.
+    if (timer >= 0) return 0;
+    if (battery_read(&r) < 0) return -1;
+
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer < 0) return -1;
+    if (timerfd_settime(timer, 0, &every, NULL) < 0 || daemon_watch(timer, battery_timer) < 0) return -1;
+
+    battery_sample();
+    return 0;
+}
+
+static void battery_timer (int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+
+    battery_sample();
+
+    // Not every battery sends a uevent as its charge drops, so the tiers are checked here too.
+    if (monitor.timer > 0) monitor_arm(0);
+}
+
+
+static void hotplug_uevent (int fd) {
+    // Enumerate again at the next switch; until then new devices keep their defaults.
+    static const char* const buses[] = { "pci", "usb", "scsi_host", "block", "nvme", "drm", "backlight", NULL };
+    if (uevent_read(fd, buses)) {
+        caps_invalidate();
+        devices_rescan();
+        storage_rescan();
+        display_rescan();
+    }
+}
+
+
+static int triggers_start (int standalone) {
+    char dir[PATH_MAX];
+
+    trig.events = proc_open();
+    trig.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    trig.inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    trig.standalone = standalone;
+    trig.active = -1;
+    trig.flags = flags;
+
+    if (trig.events < 0 || trig.timer < 0) return -1;
+    if (daemon_watch(trig.events, triggers_event) < 0) return -1;
+    if (daemon_watch(trig.timer, triggers_timer) < 0) return -1;
+
+    // Without the directory there's nothing to reload, but the built-ins still work.
+    if (trig.inotify >= 0 &&
+        inotify_add_watch(trig.inotify, sysfs_path(PWR_PROFILE_DIR, dir, sizeof(dir)), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) >= 0)
+        daemon_watch(trig.inotify, triggers_reload);
+
+    triggers_load();
+    return 0;
+}
+
+static void triggers_load () {
+    static pid_t running[32768];
+    int count;
+    const struct profile* all = profile_all(&count);
+
+    trig.rules = trig.tracked = 0;
+    for (int i = 0; i < count && trig.rules < MAX_TRIGGERS; i++) {
+        if (!all[i].value[K_TRIGGERS][0]) continue;
+        snprintf(trig.profile[trig.rules], PROFILE_NAME_MAX, "%s", all[i].name);
+        snprintf(trig.patterns[trig.rules++], PROFILE_VALUE_MAX, "%s", all[i].value[K_TRIGGERS]);
+    }
+
+    // The one time /proc is walked: programs that were already running when we started, or
+    // that a new rule now covers. From here on the connector says what comes and goes.
+    int n = proc_list(running, sizeof(running) / sizeof(running[0]));
+    for (int i = 0; i < n; i++)
+        triggers_exec(running[i]);
+
+    triggers_update();
+}
+
+static void triggers_event (int fd) {
+    struct proc_change changes[256];
+    int count = proc_read(fd, changes, sizeof(changes) / sizeof(changes[0]));
+
+    // Some events were lost, so start over from what's running now.
+    if (count < 0) {
+        triggers_load();
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        triggers_forget(changes[i].pid);
+        if (!changes[i].exited) triggers_exec(changes[i].pid);
+    }
+
+    if (count > 0) triggers_update();
+}
 
-// Regular User ID
-static int ruid;
+static void triggers_reload (int fd) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(fd, events, sizeof(events)) > 0);
+    triggers_load();
+}
 
-// All cmdline flags after parsing.
-struct s_flags {
-    const char* program_name;  // argv[0]
-    int (*action)();           // Action for program to perform.
-    int no_restart;            // Flag: disables restarting of display manager.
-};
+static void triggers_timer (int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 || trig.tracked > 0 || trig.active < 0) return;
 
-// The actual parsed go into this struct instance.
-static struct s_flags flags;
+    trig.active = -1;
+    triggers_switch(trig.restore);
+}
 
-// Returns true if an executable file exists at the given path.
-static int binary_exists (const char* path);
+static void triggers_exec (pid_t pid) {
+    char name[32];
 
-static const char* wlan_name (); // Get wifi interface name.
+    if (trig.rules == 0 || trig.tracked == MAX_TRIGGERED || proc_name(pid, name, sizeof(name)) < 0) return;
 
-static void restart_display_manager ();       // Uses systemctl to restart display-manager.
-static void prime_select (const char* card);  // Uses prime-select to switch GPUs.
-static void wifi_power (const char* state);   // Set wifi power-saving state.
-static void cpu_governor (const char* rule);  // Set performance governor.
+    for (int r = 0; r < trig.rules; r++) {
+        if (!proc_matches(trig.patterns[r], name)) continue;
+        trig.pids[trig.tracked] = pid;
+        trig.rule[trig.tracked++] = r;
+        return;
+    }
+}
 
-static const char* get_pwr_state ();           // Get the power state info.
-static void set_pwr_state (const char* state); // Save the power state info.
+static void triggers_forget (pid_t pid) {
+    for (int i = 0; i < trig.tracked; i++) {
+        if (trig.pids[i] != pid) continue;
 
-static int glob_error (const char* path, int error); // Handle glob errors.
+        // Keep the order, so the newest program still decides.
+        memmove(&trig.pids[i], &trig.pids[i + 1], (trig.tracked - i - 1) * sizeof(trig.pids[0]));
+        memmove(&trig.rule[i], &trig.rule[i + 1], (trig.tracked - i - 1) * sizeof(trig.rule[0]));
+        trig.tracked--;
+        return;
+    }
+}
 
-// Actions that may be performed by the program, depending on flags given.
-static int action_none ();       // No action specified, print error and exit.
-static int action_perform ();    // Enable performance mode.
-static int action_powersave ();  // Enable power-saving mode.
-static int action_version ();    // Print version information.
-static int action_help ();       // Print help information.
+static void triggers_update () {
+    struct itimerspec when = { { 0, 0 }, { 0, 0 } };
+    int want = trig.tracked > 0 ? trig.rule[trig.tracked - 1] : -1;
 
-static int parse_args (int argc, char** argv); // Parse cmdline args and set appropriate flags.
+    // A build runs one compiler after another, so wait a moment before going back.
+    if (want < 0) {
+        long ms = trig.flags.debounce_ms > 0 ? trig.flags.debounce_ms : 1;
+        when.it_value = (struct timespec){ ms / 1000, (ms % 1000) * 1000000 };
+        if (trig.active >= 0) timerfd_settime(trig.timer, 0, &when, NULL);
+        return;
+    }
 
+    timerfd_settime(trig.timer, 0, &when, NULL);
+    if (want == trig.active) return;
 
-int main (int argc, char** argv) {
-    ruid = geteuid();
+    if (trig.active < 0) {
+        if (trig.standalone) current_state[0] = 0;
+        snprintf(trig.restore, sizeof(trig.restore), "%s", get_pwr_state());
+    }
 
-    int result = parse_args(argc, argv);
-    if (result != E_OK) return result;
+    trig.active = want;
+    triggers_switch(trig.profile[want]);
+}
 
-    return flags.action();
+static void triggers_switch (const char* profile) {
+    flags = trig.flags;
+    flags.profile = profile;
+    action_profile();
+    fflush(stdout);
 }
 
+static int schedule_start (int standalone) {
+    char dir[PATH_MAX];
 
-static int binary_exists (const char* path) {
-    struct stat status;
-    if (stat(path, &status) < 0) return 0;
-    return status.st_mode & S_IEXEC != 0;
+    sched.timer = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    sched.sampler = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    sched.inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    sched.standalone = standalone;
+    sched.active = 0;
+    sched.flags = flags;
+
+    if (sched.timer < 0 || sched.sampler < 0) return -1;
+    if (daemon_watch(sched.timer, schedule_timer) < 0) return -1;
+    if (daemon_watch(sched.sampler, schedule_sample) < 0) return -1;
+
+    if (sched.inotify >= 0 &&
+        inotify_add_watch(sched.inotify, sysfs_path(PWR_CONFIG_DIR, dir, sizeof(dir)), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) >= 0)
+        daemon_watch(sched.inotify, schedule_reload);
+
+    sched.rules = schedule_load(sched.rule, SCHEDULE_MAX);
+    schedule_plan();
+    return 0;
 }
 
-static const char* wlan_name () {
-    struct ifaddrs* iface;
-    getifaddrs(&iface);
-    struct ifaddrs* first = iface;
+static void schedule_plan () {
+    struct itimerspec when = { { 0, 0 }, { 0, 0 } };
+    struct timespec now;
+
+    // Not time(), which can lag the clock the timer runs on by a tick and see it go off early.
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (int r = 0; r < sched.rules; r++) {
+        time_t start = schedule_next(&sched.rule[r], now.tv_sec + sched.rule[r].lead_s);
+        if (start < 0) continue;
+
+        time_t at = start - sched.rule[r].lead_s;
+        if (when.it_value.tv_sec == 0 || at < when.it_value.tv_sec) when.it_value.tv_sec = at;
+    }
+
+    // Absolute, so a suspended laptop still switches on time once it wakes; cancelled when
+    // the clock is set, so a jump doesn't leave it waiting for the wrong moment.
+    sched.next = when.it_value.tv_sec;
+    timerfd_settime(sched.timer, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &when, NULL);
+}
+
+static void schedule_timer (int fd) {
+    struct itimerspec every = { { SCHEDULE_SAMPLE_S, 0 }, { SCHEDULE_SAMPLE_S, 0 } };
+    uint64_t expirations;
+    int due = -1;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == ECANCELED) schedule_plan();
+        return;
+    }
 
-    int found = 0;
+    // The jobs the timer was set for, even if it went off late; the first to start wins.
+    time_t start = 0;
+    for (int r = 0; r < sched.rules; r++) {
+        time_t s = schedule_next(&sched.rule[r], sched.next + sched.rule[r].lead_s - 1);
+        if (s < 0 || s - sched.rule[r].lead_s != sched.next || (due >= 0 && s >= start)) continue;
+        due = r;
+        start = s;
+    }
 
-    while (iface != NULL) {
-        if (iface->ifa_name[0] == 'w' && iface->ifa_name[1] == 'l') {
-            found = 1;
-            break;
+    if (due >= 0) {
+        if (!sched.active) {
+            if (sched.standalone) current_state[0] = 0;
+            snprintf(sched.restore, sizeof(sched.restore), "%s", get_pwr_state());
         }
 
-        iface = iface->ifa_next;
+        sched.active = 1;
+        sched.current = sched.rule[due];
+        sched.started = start;
+        sched.usage = -1;
+        sched.idle_since = (struct timespec){ 0, 0 };
+        timerfd_settime(sched.sampler, 0, &every, NULL);
+        schedule_switch(sched.current.profile);
+    }
+
+    schedule_plan();
+}
+
+static void schedule_sample (int fd) {
+    struct itimerspec stop = { { 0, 0 }, { 0, 0 } };
+    const struct schedule_rule* r = &sched.current;
+    uint64_t expirations;
+    struct timespec now;
+    int done = 0;
+
+    // Still in the lead time, waiting for the job to start.
+    if (read(fd, &expirations, sizeof(expirations)) < 0 || !sched.active || time(NULL) < sched.started) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (r->cgroup[0]) {
+        long long usage = schedule_usage(r->cgroup);
+        long ms = ms_between(&sched.sampled, &now);
+
+        // Busy is a share of one CPU; a cgroup that's gone, or not there yet, counts as idle.
+        double busy = usage < 0 ? 0 : sched.usage < 0 || ms <= 0 ? 100 : (usage - sched.usage) / (ms * 10.0);
+        sched.usage = usage;
+        sched.sampled = now;
+
+        if (busy >= sched.flags.load_low) sched.idle_since = (struct timespec){ 0, 0 };
+        else if (sched.idle_since.tv_sec == 0 && sched.idle_since.tv_nsec == 0) sched.idle_since = now;
+        else done = ms_between(&sched.idle_since, &now) >= sched.flags.idle_for * 1000L;
     }
 
-    char* ifname = (char*)malloc(strlen(iface->ifa_name) + 1);
-    strcpy(ifname, iface->ifa_name);
+    // for= is how long the job takes, or with a cgroup, the most it's allowed.
+    if (r->for_s > 0 && time(NULL) >= sched.started + r->for_s) done = 1;
+    if (!done) return;
+
+    sched.active = 0;
+    timerfd_settime(sched.sampler, 0, &stop, NULL);
+    schedule_switch(sched.restore);
+}
+
+static void schedule_reload (int fd) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(fd, events, sizeof(events)) > 0);
 
-    freeifaddrs(first);
-    if (found) return ifname;
-    else return NULL;
+    // A job already running keeps its rule until it's done.
+    sched.rules = schedule_load(sched.rule, SCHEDULE_MAX);
+    schedule_plan();
+}
 
+static void schedule_switch (const char* profile) {
+    flags = sched.flags;
+    flags.profile = profile;
+    action_profile();
+    fflush(stdout);
 }
 
+static int metrics_start () {
+    struct itimerspec every = { { METRICS_INTERVAL_S, 0 }, { METRICS_INTERVAL_S, 0 } };
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
 
-static void restart_display_manager () {
-    if (!flags.no_restart && binary_exists("/bin/systemctl"))
-        fexecl("/bin/systemctl", "systemctl", "restart", "display-manager");
+    if (timer < 0 || energy_open(&power_meter) == 0) return -1;
+    if (timerfd_settime(timer, 0, &every, NULL) < 0 || daemon_watch(timer, metrics_timer) < 0) return -1;
+
+    metrics_power(&power_meter, ac_online());
+    return 0;
 }
 
-static void prime_select (const char* card) {
-    if (binary_exists("/usr/bin/prime-select"))
-        fexecl("/usr/bin/prime-select", "prime-select", card);
+static void metrics_timer (int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+
+    energy_sample(&power_meter);
+    metrics_power(&power_meter, ac_online());
+
+    if (metrics_file != NULL && metrics_save(metrics_file, get_pwr_state()) < 0)
+        fprintf(stderr, "Couldn't write metrics to %s: %s\n", metrics_file, strerror(errno));
 }
 
-static void wifi_power (const char* state) {
-    const char* iface = wlan_name();
+static int auto_start (int standalone) {
+    autosw.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    autosw.interval_ms = AUTO_MIN_MS;
+    autosw.standalone = standalone;
+    autosw.flags = flags;
+
+    if (load_open(&autosw.meter) < 0 || autosw.timer < 0) return -1;
+    if (daemon_watch(autosw.timer, auto_timer) < 0) return -1;
+
+    // Let the kernel batch our other wakeups with everyone else's.
+    prctl(PR_SET_TIMERSLACK, 50 * 1000000UL);
 
-    if (binary_exists("/sbin/iwconfig") && iface != NULL)
-        fexecl("/sbin/iwconfig", "iwconfig", iface, "power", state);
-    
-    free((void*)iface);
+    auto_arm();
+    return 0;
 }
 
-static void cpu_governor (const char* rule) {
-    glob_t results = { 0 };
+static void auto_arm () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    glob("/sys/devices/system/cpu/cpu*/cpufreq/scaling_governor", 0, glob_error, &results);
+    // timerfd has no slack of its own, so fire on whole seconds instead, where other periodic
+    // timers tend to be, and the CPU can wake once for all of them.
+    struct itimerspec when = { { 0, 0 }, { now.tv_sec + (autosw.interval_ms + 999) / 1000, 0 } };
+    timerfd_settime(autosw.timer, TFD_TIMER_ABSTIME, &when, NULL);
+}
 
-    for (int i = 0; i < results.gl_pathc; i++) {
-        FILE* f = fopen(results.gl_pathv[i], "w");
-        ehandle(f == NULL, E_CPUFREQ_WRITE);
-        fprintf(f, "%s\n", rule);
-        fclose(f);
+static void auto_timer (int fd) {
+    uint64_t expirations;
+    struct load_sample sample;
+    struct timespec now;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+    load_sample(&autosw.meter, &sample);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (autosw.standalone) current_state[0] = 0;
+    const char* state = get_pwr_state();
+    const char* want = auto_wants(&sample);
+    const struct s_flags* f = &autosw.flags;
+
+    // Nothing to do, or a profile someone picked by hand: sample less and less often.
+    if (want == NULL || !strcmp(want, state) || (strcmp(state, "perform") && strcmp(state, "powersave"))) {
+        autosw.want = NULL;
+        autosw.interval_ms = autosw.interval_ms * 2 > AUTO_MAX_MS ? AUTO_MAX_MS : autosw.interval_ms * 2;
+        auto_arm();
+        return;
     }
 
-    globfree(&results);
+    if (autosw.want != want) {
+        autosw.want = want;
+        autosw.since = now;
+    }
+
+    // Overheating can't wait; anything else has to last, and not come too soon after the last
+    // switch, since a GPU switch can mean restarting the whole session.
+    int hot = f->temp_max > 0 && sample.temp >= f->temp_max;
+    long needed = (!strcmp(want, "perform") ? f->busy_for : f->idle_for) * 1000L;
+    int settled = ms_between(&autosw.since, &now) >= needed &&
+                  (!autosw.switched || ms_between(&autosw.last, &now) >= f->hysteresis_s * 1000L);
+
+    if (hot || settled) {
+        flags = autosw.flags;
+        if (!strcmp(want, "perform")) action_perform();
+        else action_powersave();
+        fflush(stdout);
+
+        autosw.want = NULL;
+        autosw.last = now;
+        autosw.switched = 1;
+    }
+
+    autosw.interval_ms = AUTO_MIN_MS;
+    auto_arm();
+}
+
+static const char* auto_wants (const struct load_sample* s) {
+    const struct s_flags* f = &autosw.flags;
+
+    if (f->temp_max > 0 && s->temp >= f->temp_max) return "powersave";
+    if (s->busy * 100 >= f->load_high || s->pressure >= f->pressure_high) return "perform";
+
+    // Idle means quiet on both counts; anything in between keeps the current mode.
+    if (s->busy >= 0 && s->busy * 100 <= f->load_low && s->pressure < f->pressure_high / 2) return "powersave";
+    return NULL;
+}
+
+static long ms_between (const struct timespec* a, const struct timespec* b) {
+    return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
 }
 
 
 static const char* get_pwr_state () {
-    FILE* pstate = fopen("/var/lib/pwr_state", "r");
-    ehandle(pstate == NULL, E_PWR_STATE_READ);
+    if (current_state[0]) return current_state;
 
-    // Default if we can't read the file.
-    if (pstate == NULL) return "perform";
-    char* result = NULL;
-    size_t len = 0;
-    getline(&result, &len, pstate);
-    fclose(pstate);
+    // Default if we can't read the file, e.g. before the first switch.
+    if (sysfs_read(STATE_FILE, current_state, sizeof(current_state)) < 0 || !current_state[0])
+        snprintf(current_state, sizeof(current_state), "perform");
 
-    // Remove trailing newline, if any.
-    result[strcspn(result, "\n")] = 0;
+    return current_state;
+}
 
-    return result;
+static const char* hardware_state () {
+    char buf[32];
+    const char* governor = NULL;
+
+    // The governor is the cheapest thing to check, and with the PRIME selection tells apart
+    // profiles that share one.
+    if (sysfs_read("/sys/devices/system/cpu/cpufreq/policy0/scaling_governor", buf, sizeof(buf)) == 0 ||
+        sysfs_read("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", buf, sizeof(buf)) == 0)
+        governor = buf;
+
+    const char* card = prime_available() ? prime_current() : NULL;
+    if (governor == NULL && card == NULL) return get_pwr_state();
+
+    return matching_profile(governor, card);
+}
+
+static const char* matching_profile (const char* governor, const char* card) {
+    const char* seen[] = { [K_GOVERNOR] = governor, [K_GPU] = card };
+    const int knobs[] = { K_GOVERNOR, K_GPU };
+    const char* recorded = get_pwr_state();
+    const char* best = "unknown";
+    int best_score = 0, count;
+
+    // A profile fits if everything it sets that could be read matches; of those, the one that
+    // matches the most wins, and the recorded one wins a tie.
+    const struct profile* all = profile_all(&count);
+    for (int i = 0; i < count; i++) {
+        int score = 0;
+        for (size_t k = 0; k < sizeof(knobs) / sizeof(knobs[0]) && score >= 0; k++) {
+            const char* set = all[i].value[knobs[k]];
+            if (seen[knobs[k]] == NULL || !set[0]) continue;
+            score = strcmp(set, seen[knobs[k]]) ? -1 : score + 1;
+        }
+
+        if (score > best_score || (score > 0 && score == best_score && !strcmp(all[i].name, recorded))) {
+            best = all[i].name;
+            best_score = score;
+        }
+    }
+
+    return best;
 }
 
-static void set_pwr_state (const char* state) {
-    FILE* pstate = fopen("/var/lib/pwr_state", "w");
-    ehandle(pstate == NULL, E_PWR_STATE_WRITE);
-    fprintf(pstate, "%s\n", state);
-    fclose(pstate);
+static int set_pwr_state (const char* state) {
+    // Written to the side and renamed into place, so readers never see a half-written file.
+    char buf[PATH_MAX], file[PATH_MAX];
+    const char* tmp = sysfs_path(STATE_DIR "/." STATE_NAME ".tmp", buf, sizeof(buf));
+    FILE* pstate = fopen(tmp, "w");
+
+    if (pstate == NULL && errno == EACCES) {
+        if (sysfs_helper_write(STATE_FILE, state) < 0) {
+            if (errno == ENOSYS) errno = EACCES;
+            return -1;
+        }
+
+        snprintf(current_state, sizeof(current_state), "%s", state);
+        return 0;
+    }
+
+    if (pstate == NULL) return -1;
+
+    int ok = fprintf(pstate, "%s\n", state) > 0;
+    ok = fclose(pstate) == 0 && ok;
+    if (!ok || rename(tmp, sysfs_path(STATE_FILE, file, sizeof(file))) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    snprintf(current_state, sizeof(current_state), "%s", state);
+    return 0;
 }
 
 
 // Kindly provided by u/lordvadr on reddit.
-static int glob_error (const char* path, int error) {
+int glob_error (const char* path, int error) {
     if (path)
         fprintf(stderr, "glob: %s: %s\n", path, strerror(error));
     else
@@ -205,43 +1620,311 @@ static int action_none () {
 }
 
 static int action_perform () {
+    flags.profile = "perform";
+    return action_profile();
+}
+
+static int action_powersave () {
+    flags.profile = "powersave";
+    return action_profile();
+}
+
+static int action_profile () {
+    const struct profile* p = profile_find(flags.profile);
+
+    if (p == NULL) {
+        fprintf(stderr, "Unknown profile: %s\n", flags.profile);
+        return E_BAD_ARG;
+    }
+
+    return apply_profile(p);
+}
+
+static int action_query () {
+    const char* (*query)() = flags.hardware ? hardware_state : get_pwr_state;
+    char last[PROFILE_NAME_MAX];
+
+    snprintf(last, sizeof(last), "%s", query());
+    puts(last);
+    if (!flags.watch) return E_OK;
+
+    // Every switch rewrites the state file, so that's the one thing worth waiting on.
+    int fd = inotify_init1(IN_CLOEXEC);
+    char dir[PATH_MAX];
+    ehandle(fd < 0 || inotify_add_watch(fd, sysfs_path(STATE_DIR, dir, sizeof(dir)), IN_CLOSE_WRITE | IN_MOVED_TO) < 0, E_PWR_STATE_READ);
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        fflush(stdout);
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len < 0 && errno == EINTR) continue;
+        ehandle(len <= 0, E_PWR_STATE_READ);
+
+        int relevant = 0;
+        for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->len && !strcmp(ev->name, STATE_NAME)) relevant = 1;
+        }
+        if (!relevant) continue;
+
+        current_state[0] = 0;
+        const char* state = query();
+        if (strcmp(state, last)) {
+            snprintf(last, sizeof(last), "%s", state);
+            puts(last);
+        }
+    }
+}
+
+static int action_toggle () {
+    const char* state = get_pwr_state();
+    if (!strcmp(state, "powersave")) return action_perform();
+    else return action_powersave();
+}
+
+static int action_daemon () {
     seteuid(0);
+    cpu_discover();
+    gpu_discrete();
+    devices_discover();
+    storage_discover();
+    caps_save();
+
+    int hotplug = uevent_open();
+    if (hotplug >= 0) daemon_watch(hotplug, hotplug_uevent);
+
+    get_pwr_state();
+    battery_start();
+
+    ehandle(flags.monitor && monitor_start() < 0, E_DAEMON);
+    ehandle(flags.automatic && auto_start(0) < 0, E_DAEMON);
+    ehandle(flags.triggers && triggers_start(0) < 0, E_DAEMON);
+    ehandle(flags.schedule && schedule_start(0) < 0, E_DAEMON);
+
+    // Requests reset flags, so keep our own copy of the path.
+    metrics_file = flags.textfile;
+    if ((flags.metrics || metrics_file) && metrics_start() < 0)
+        fprintf(stderr, "No RAPL or battery power readings available for metrics\n");
+    char socket[PATH_MAX];
+    ehandle(daemon_serve(sysfs_path(PWR_SOCKET, socket, sizeof(socket)), serve_request) < 0, E_DAEMON);
+    return E_OK;
+}
 
-    cpu_governor("performance");
-    prime_select("nvidia");
-    wifi_power("off");
-    restart_display_manager();
+static int action_monitor () {
+    ehandle(monitor_start() < 0, E_DAEMON);
+    ehandle(daemon_serve(NULL, NULL) < 0, E_DAEMON);
+    return E_OK;
+}
 
-    set_pwr_state("perform");
+static int action_auto () {
+    ehandle(auto_start(1) < 0, E_DAEMON);
+    ehandle(daemon_serve(NULL, NULL) < 0, E_DAEMON);
+    return E_OK;
+}
 
-    seteuid(ruid);
+static int action_triggers () {
+    ehandle(triggers_start(1) < 0, E_DAEMON);
+    ehandle(daemon_serve(NULL, NULL) < 0, E_DAEMON);
     return E_OK;
 }
 
-static int action_powersave () {
-    seteuid(0);
+static int compare_time (const void* a, const void* b) {
+    time_t x = *(const time_t*)a, y = *(const time_t*)b;
+    return (x > y) - (x < y);
+}
 
-    cpu_governor("powersave");
-    prime_select("intel");
-    wifi_power("on");
-    restart_display_manager();
+static int action_schedule () {
+    struct schedule_rule rules[SCHEDULE_MAX];
+    struct { time_t at, start; int rule; } events[256];
+    int count = 0;
 
-    set_pwr_state("powersave");
+    if (flags.watch) {
+        ehandle(schedule_start(1) < 0, E_DAEMON);
+        ehandle(daemon_serve(NULL, NULL) < 0, E_DAEMON);
+        return E_OK;
+    }
 
-    seteuid(ruid);
+    int n = schedule_load(rules, SCHEDULE_MAX);
+    if (n < 0) {
+        fprintf(stderr, "No schedule in %s\n", PWR_SCHEDULE);
+        return E_NO_ACTION;
+    }
+
+    // Every switch in the next day, in order.
+    time_t now = time(NULL);
+    for (int r = 0; r < n; r++) {
+        for (time_t t = now; count < 256; ) {
+            time_t start = schedule_next(&rules[r], t + rules[r].lead_s);
+            if (start < 0 || start - rules[r].lead_s > now + TIMELINE_S) break;
+
+            events[count].at = start - rules[r].lead_s;
+            events[count].start = start;
+            events[count++].rule = r;
+            t = start - rules[r].lead_s;
+        }
+    }
+
+    qsort(events, count, sizeof(events[0]), compare_time);
+
+    for (int i = 0; i < count; i++) {
+        const struct schedule_rule* r = &rules[events[i].rule];
+        char at[32], start[16];
+        struct tm tm;
+
+        strftime(at, sizeof(at), "%a %H:%M:%S", localtime_r(&events[i].at, &tm));
+        strftime(start, sizeof(start), "%H:%M", localtime_r(&events[i].start, &tm));
+        printf("%s  %-12s job at %s (line %d), ", at, r->profile, start, r->line);
+
+        if (r->cgroup[0]) printf("back once %s is idle\n", r->cgroup);
+        else printf("back after %d s\n", r->for_s);
+    }
+
+    if (count == 0) printf("Nothing scheduled in the next %d hours.\n", TIMELINE_S / 3600);
     return E_OK;
 }
 
-static int action_query () {
-    puts(get_pwr_state());
+// Heap allocations so far, if bench/alloc.c is linked in to count them.
+extern unsigned long pwr_allocations __attribute__((weak));
+
+static int compare_double (const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int action_bench () {
+    static const struct {
+        const char* name;
+        int (*action)();
+    } actions[] = { { "perform", action_perform }, { "powersave", action_powersave }, { "toggle", action_toggle } };
+
+    int switches = flags.cycles * 2;
+    if (switches <= 0) return E_BAD_ARG;
+
+    double* samples = calloc(switches * T_COUNT, sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "bench: %s\n", strerror(errno));
+        return E_NO_ACTION;
+    }
+
+    double seconds[3] = { 0 };
+    unsigned long allocations[3] = { 0 };
+    int counts[3] = { 0 };
+    char original[16];
+    snprintf(original, sizeof(original), "%s", get_pwr_state());
+
+    // Alternating perform and powersave gives the per-step latencies, then toggle runs as many
+    // times again on its own.
+    flags.quiet = 1;
+    for (int i = 0; i < switches * 2; i++) {
+        int a = i >= switches ? 2 : i % 2;
+        struct timespec start;
+        unsigned long before = &pwr_allocations ? pwr_allocations : 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        actions[a].action();
+        seconds[a] += usec_since(&start) / 1e6;
+        allocations[a] += (&pwr_allocations ? pwr_allocations : 0) - before;
+        counts[a]++;
+
+        for (int t = 0; i < switches && t < T_COUNT; t++)
+            samples[t * switches + i] = timings[t];
+    }
+
+    if (strcmp(get_pwr_state(), original)) {
+        if (!strcmp(original, "perform")) action_perform();
+        if (!strcmp(original, "powersave")) action_powersave();
+    }
+
+    printf("%d switches%s\n", switches, flags.no_restart ? " (no display manager restart)" : "");
+    printf("%-24s %12s %12s %12s\n", "step (us)", "min", "median", "p99");
+
+    for (int t = 0; t < T_COUNT; t++) {
+        double* s = samples + t * switches;
+        qsort(s, switches, sizeof(double), compare_double);
+
+        int p99 = (switches * 99 + 99) / 100 - 1;
+        printf("%-24s %12.1f %12.1f %12.1f\n", timing_name(t), s[0], s[switches / 2], s[p99]);
+    }
+
+    // Allocations can only be counted by pwr-bench, which brings its own malloc().
+    printf("\n%-24s %12s %12s\n", "action", "switches/s", "allocs/switch");
+    for (int a = 0; a < 3; a++) {
+        printf("%-24s %12.1f", actions[a].name, counts[a] / seconds[a]);
+        if (&pwr_allocations) printf(" %12.1f\n", (double)allocations[a] / counts[a]);
+        else printf(" %12s\n", "-");
+    }
+
+    free(samples);
     return E_OK;
 }
 
-static int action_toggle () {
-    const char* state = get_pwr_state();
-    if (!strcmp(state, "powersave")) return action_perform();
-    else return action_powersave();
-    free((void*)state);
+static int action_measure () {
+    struct energy_meter meter;
+
+    // energy_uj is root-only on kernels with the PLATYPUS fix.
+    seteuid(0);
+    int sources = energy_open(&meter);
+    seteuid(ruid);
+
+    if (sources == 0) {
+        fprintf(stderr, "No RAPL or battery power readings available\n");
+        return E_NO_ACTION;
+    }
+
+    // Sample every second: often enough to catch each counter wrap and to average power_now.
+    for (double left = flags.seconds; left > 0; left -= 1) {
+        double step = left < 1 ? left : 1;
+        struct timespec pause = { (time_t)step, (long)((step - (time_t)step) * 1e9) };
+        nanosleep(&pause, NULL);
+        energy_sample(&meter);
+    }
+
+    double elapsed = energy_elapsed(&meter);
+    printf("Mode: %s, %.1f s\n", get_pwr_state(), elapsed);
+
+    for (int i = 0; i < meter.zones; i++)
+        printf("%-12s %8.2f W\n", meter.zone[i].name, meter.zone[i].joules / elapsed);
+
+    double battery = energy_battery_watts(&meter);
+    if (battery >= 0) printf("%-12s %8.2f W (%s)\n", "battery", battery, meter.battery_status);
+
+    energy_close(&meter);
+    return E_OK;
+}
+
+static int action_top () {
+    if (top_open() < 0) {
+        if (errno == ENOENT) fprintf(stderr, "No CPUs found\n");
+        else fprintf(stderr, "top: %s\n", strerror(errno));
+        return E_NO_ACTION;
+    }
+
+    // Our own wakeups are part of what's measured, so let them batch with everyone else's.
+    prctl(PR_SET_TIMERSLACK, 50 * 1000000UL);
+
+    int tty = isatty(STDOUT_FILENO);
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (;;) {
+        next.tv_sec += (time_t)flags.seconds;
+        next.tv_nsec += (long)((flags.seconds - (time_t)flags.seconds) * 1e9);
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+        top_sample();
+
+        // Redraw in place on a terminal; anywhere else, one report after another.
+        if (tty) fputs("\033[H\033[J", stdout);
+        else putchar('\n');
+        top_report(stdout, TOP_WINDOW, TOP_ROWS);
+        fflush(stdout);
+    }
+
+    return E_OK;
 }
 
 static int action_version () {
@@ -258,12 +1941,48 @@ static int action_help () {
     puts("Actions:");
     puts(" perform (pe)      Go into performance mode.");
     puts(" powersave (ps)    Go into power-saving mode.");
+    puts(" PROFILE           Switch to a profile from " PWR_PROFILE_DIR "/PROFILE.conf.");
     puts(" toggle (to)       Toggles the current state.");
     puts(" query (qu)        Query the current state, prints 'perform' or 'powersave'.");
+    puts(" daemon            Run as pwrd, serving the other actions on " PWR_SOCKET ".");
+    puts(" monitor (mo)      Stay running, switching to perform on AC power and powersave on battery,");
+    puts("                   stepping down to profiles with battery_below as charge runs out.");
+    puts(" auto              Stay running, switching to perform under sustained load and powersave when idle.");
+    puts(" triggers          Stay running, switching to a profile while any program in its triggers runs.");
+    puts(" schedule          Print when the jobs in " PWR_SCHEDULE " will be switched for over the next day.");
+    puts(" bench             Time repeated perform/powersave cycles and report per-step latency.");
+    puts(" measure [SECONDS] Sample RAPL and battery power for a while (default 10) and report watts.");
+    puts(" top [SECONDS]     Show C-state and P-state residency per CPU and the top waking processes,");
+    puts("                   refreshed every SECONDS (default 2).");
+    puts(" metrics           Print pwrd's switch statistics and power readings for Prometheus.");
+    puts(" battery           Print the battery's discharge rate and time to empty, from pwrd's samples.");
     puts(" --help            Prints this help information.");
     puts(" --version         Prints version, contact, and copyright information.\n");
     puts("Flags:");
     puts(" --norestart (-n)  Do not restart display manager after changing modes.");
+    puts(" --nowait          Don't wait for the display manager to finish restarting.");
+    puts(" --trace           Print timing information for each step and change to stderr.");
+    puts(" --quiet (-q)      Don't print what changed.");
+    puts(" --cycles N        Number of perform/powersave cycles for bench (default 10).");
+    puts(" --force (-f)      Apply every setting, even if the hardware already matches.");
+    puts(" --monitor         With daemon, also switch modes on AC power events.");
+    puts(" --debounce MS     Wait for power events to settle this long before switching (default 2000).");
+    puts(" --hysteresis S    Leave at least this long between automatic switches (default 30).");
+    puts(" --auto            With daemon, also switch modes on load and temperature.");
+    puts(" --load-high P     CPU busy percentage that counts as load for auto (default 60).");
+    puts(" --load-low P      CPU busy percentage that counts as idle for auto (default 15).");
+    puts(" --pressure P      CPU pressure (PSI avg10) percentage that counts as load (default 20).");
+    puts(" --temp-max C      Force powersave at this temperature, or 0 to ignore it (default 90).");
+    puts(" --busy-for S      How long load must last before auto switches to perform (default 5).");
+    puts(" --idle-for S      How long idle must last before auto switches to powersave (default 30).");
+    puts(" --triggers        With daemon, also switch profiles while the programs in their triggers run.");
+    puts(" --schedule        With daemon, also switch ahead of the jobs in " PWR_SCHEDULE ".");
+    puts(" --metrics         With daemon, sample power draw every 15 seconds for metrics.");
+    puts(" --textfile PATH   With daemon, also keep the metrics in PATH for node_exporter.");
+    puts(" --root DIR        Look up /sys, /proc, /etc, /var, /run and helper programs under DIR.");
+    puts(" --hardware        With query, read the state from the hardware rather than " STATE_FILE ".");
+    puts(" --watch           With query, keep running and print the state again whenever it changes.");
+    puts("                   With schedule, keep running and switch ahead of each job.");
     return E_OK;
 }
 
@@ -272,6 +1991,30 @@ static int parse_args (int argc, char** argv) {
     flags.action = action_none;
     flags.program_name = argv[0];
     flags.no_restart = 0;
+    flags.no_wait = 0;
+    flags.trace = 0;
+    flags.force = 0;
+    flags.monitor = 0;
+    flags.debounce_ms = 2000;
+    flags.hysteresis_s = 30;
+    flags.automatic = 0;
+    flags.load_high = 60;
+    flags.load_low = 15;
+    flags.pressure_high = 20;
+    flags.temp_max = 90;
+    flags.busy_for = 5;
+    flags.idle_for = 30;
+    flags.triggers = 0;
+    flags.schedule = 0;
+    flags.metrics = 0;
+    flags.textfile = NULL;
+    flags.root = NULL;
+    flags.hardware = 0;
+    flags.watch = 0;
+    flags.quiet = 0;
+    flags.cycles = 10;
+    flags.seconds = 10;
+    flags.profile = NULL;
 
     for (int i = 1; i < argc; i++) {
         const char* arg = argv[i];
@@ -288,6 +2031,40 @@ static int parse_args (int argc, char** argv) {
         else if (!strcmp(arg, "toggle") || !strcmp(arg, "to"))
             flags.action = action_toggle;
         
+        else if (!strcmp(arg, "daemon"))
+            flags.action = action_daemon;
+
+        else if (!strcmp(arg, "monitor") || !strcmp(arg, "mo"))
+            flags.action = action_monitor;
+
+        else if (!strcmp(arg, "auto"))
+            flags.action = action_auto;
+
+        else if (!strcmp(arg, "triggers"))
+            flags.action = action_triggers;
+        else if (!strcmp(arg, "schedule"))
+            flags.action = action_schedule;
+
+        else if (!strcmp(arg, "metrics"))
+            flags.action = action_metrics;
+
+        else if (!strcmp(arg, "battery"))
+            flags.action = action_battery;
+
+        else if (!strcmp(arg, "bench"))
+            flags.action = action_bench;
+
+        else if (!strcmp(arg, "top")) {
+            flags.action = action_top;
+            flags.seconds = 2;
+            if (i + 1 < argc && atof(argv[i + 1]) > 0) flags.seconds = atof(argv[++i]);
+        }
+
+        else if (!strcmp(arg, "measure")) {
+            flags.action = action_measure;
+            if (i + 1 < argc && atof(argv[i + 1]) > 0) flags.seconds = atof(argv[++i]);
+        }
+
         else if (!strcmp(arg, "--help"))
             flags.action = action_help;
 
@@ -296,7 +2073,77 @@ static int parse_args (int argc, char** argv) {
         
         else if (!strcmp(arg, "--norestart") || !strcmp(arg, "-n"))
             flags.no_restart = 1;
+
+        else if (!strcmp(arg, "--nowait"))
+            flags.no_wait = 1;
+
+        else if (!strcmp(arg, "--trace"))
+            flags.trace = 1;
+
+        else if (!strcmp(arg, "--force") || !strcmp(arg, "-f"))
+            flags.force = 1;
+
+        else if (!strcmp(arg, "--monitor"))
+            flags.monitor = 1;
+
+        else if (!strcmp(arg, "--hardware"))
+            flags.hardware = 1;
+
+        else if (!strcmp(arg, "--watch"))
+            flags.watch = 1;
+
+        else if (!strcmp(arg, "--quiet") || !strcmp(arg, "-q"))
+            flags.quiet = 1;
+
+        else if (!strcmp(arg, "--cycles") && i + 1 < argc)
+            flags.cycles = atoi(argv[++i]);
+
+        else if (!strcmp(arg, "--debounce") && i + 1 < argc)
+            flags.debounce_ms = atoi(argv[++i]);
+
+        else if (!strcmp(arg, "--hysteresis") && i + 1 < argc)
+            flags.hysteresis_s = atoi(argv[++i]);
+
+        else if (!strcmp(arg, "--auto"))
+            flags.automatic = 1;
+
+        else if (!strcmp(arg, "--triggers"))
+            flags.triggers = 1;
+        else if (!strcmp(arg, "--schedule"))
+            flags.schedule = 1;
+
+        else if (!strcmp(arg, "--metrics"))
+            flags.metrics = 1;
+
+        else if (!strcmp(arg, "--textfile") && i + 1 < argc)
+            flags.textfile = argv[++i];
+        else if (!strcmp(arg, "--root") && i + 1 < argc)
+            flags.root = argv[++i];
+
+        else if (!strcmp(arg, "--load-high") && i + 1 < argc)
+            flags.load_high = atof(argv[++i]);
+
+        else if (!strcmp(arg, "--load-low") && i + 1 < argc)
+            flags.load_low = atof(argv[++i]);
+
+        else if (!strcmp(arg, "--pressure") && i + 1 < argc)
+            flags.pressure_high = atof(argv[++i]);
+
+        else if (!strcmp(arg, "--temp-max") && i + 1 < argc)
+            flags.temp_max = atof(argv[++i]);
+
+        else if (!strcmp(arg, "--busy-for") && i + 1 < argc)
+            flags.busy_for = atoi(argv[++i]);
+
+        else if (!strcmp(arg, "--idle-for") && i + 1 < argc)
+            flags.idle_for = atoi(argv[++i]);
         
+        // Anything else that isn't a flag names a profile.
+        else if (arg[0] != '-' && flags.action == action_none) {
+            flags.action = action_profile;
+            flags.profile = arg;
+        }
+
         else {
             fprintf(stderr, "Bad argument encountered: %s\n", arg);
             return E_BAD_ARG;
@@ -305,3 +2152,37 @@ static int parse_args (int argc, char** argv) {
 
     return E_OK;
 }
+
+static int action_metrics () {
+    metrics_write(stdout, get_pwr_state());
+    return E_OK;
+}
+
+static int action_battery () {
+    battery_report(stdout);
+    return E_OK;
+}
+
+static int remote_action () {
+    return flags.action == action_perform || flags.action == action_powersave ||
+           flags.action == action_profile || flags.action == action_toggle || flags.action == action_query ||
+           flags.action == action_metrics || flags.action == action_battery;
+}
+
+static int serve_request (int argc, char** argv) {
+    int result = parse_args(argc, argv);
+    if (result != E_OK) return result;
+
+    // Clients in a fake tree name it too, since that's where they found the socket. Any other
+    // tree isn't this pwrd's to look at.
+    char given[PATH_MAX], own[PATH_MAX];
+    int other_root = flags.root != NULL && (realpath(flags.root, given) == NULL ||
+                     realpath(sysfs_root()[0] ? sysfs_root() : "/", own) == NULL || strcmp(given, own));
+
+    if (!remote_action() || flags.watch || other_root) {
+        fprintf(stderr, "Action not available through pwrd\n");
+        return E_BAD_ARG;
+    }
+
+    return flags.action();
+}
@@ -0,0 +1,502 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+#ifndef PWR_H
+#define PWR_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PWR_MAX_THREADS 8  // Upper bound on sysfs writer threads.
+#define SYSFS_VALUE_MAX 128  // Longest sysfs value written or saved.
+#define PWR_SOCKET "/run/pwr.sock"  // pwrd control socket.
+#define PWR_CONFIG_DIR "/etc/pwr"
+#define PWR_PROFILE_DIR PWR_CONFIG_DIR "/profiles.d"
+#define PWR_CACHE_DIR "/var/cache/pwr"
+#define PWR_PROFILE_CACHE PWR_CACHE_DIR "/profiles.cache"
+
+#define STATE_DIR "/var/lib"
+#define STATE_NAME "pwr_state"
+#define STATE_FILE STATE_DIR "/" STATE_NAME
+
+// pwr.c
+
+int glob_error (const char* path, int error); // Handle glob errors.
+
+// dbus.c - minimal system bus client, used to talk to systemd without forking systemctl.
+
+// Ask systemd to restart a unit. If wait is set, block until the restart job has finished.
+// Returns 0 on success, 1 if systemd refused the request and -1 if the bus is unreachable.
+int dbus_restart_unit (const char* unit, int wait);
+
+// nl80211.c - wireless power-saving over generic netlink.
+
+// Set power-saving on every wireless station interface that isn't already in that state
+// (or on all of them, if force is set).
+// Returns the number of interfaces changed, -ENOSYS if nl80211 isn't available, or -errno for
+// the first interface that couldn't be changed.
+int nl80211_set_power_save (int enabled, int force);
+
+// Put back the interfaces the last nl80211_set_power_save() changed. Returns how many failed.
+int nl80211_undo ();
+
+// sysfs.c - batched sysfs writes.
+
+// A set of sysfs attributes that are always written together. Files are opened on first write
+// and kept open, so repeated writes only cost a pwrite() each.
+struct sysfs_group {
+    int count;
+    char** paths;
+    int* fds;
+    double* usec;  // How long each write took during the last sysfs_group_write(), in microseconds.
+    int* changed;  // Whether each attribute was actually written by the last sysfs_group_write().
+    int* errors;   // errno of each failed write in the last sysfs_group_write(), or 0.
+    int* skip;     // Attributes for sysfs_group_write() to leave alone.
+    char (*saved)[SYSFS_VALUE_MAX];  // What each changed attribute held before the last write.
+};
+
+// Fill a group with every path matching a glob pattern. Returns the number of paths.
+int sysfs_group_glob (struct sysfs_group* g, const char* pattern);
+
+// Append one path to a group. Returns its index.
+int sysfs_group_add (struct sysfs_group* g, const char* path);
+
+// Write a value to every attribute in a group that doesn't already hold it (or to all of them,
+// if force is set), using up to the given number of threads.
+// Returns the number of writes that failed, with errno set from the last failure.
+int sysfs_group_write (struct sysfs_group* g, const char* value, int threads, int force);
+
+// Put back what the last sysfs_group_write() changed. Returns the number of attributes that
+// couldn't be restored.
+int sysfs_group_undo (struct sysfs_group* g);
+
+void sysfs_group_free (struct sysfs_group* g);
+
+// Read a single-line attribute into out, without its trailing newline. Returns 0 or -1.
+int sysfs_read (const char* path, char* out, size_t len);
+
+// Look every system path (/sys, /proc, /dev, /etc, /var, /run and the programs pwr runs) up
+// under another directory, e.g. a fake tree to test or benchmark against. "" is the real system.
+void sysfs_set_root (const char* path);
+const char* sysfs_root ();
+
+// path under the root: path itself if there's none, otherwise written into out.
+const char* sysfs_path (const char* path, char* out, size_t len);
+
+// The usual calls, on path under the root. Matches from sysfs_glob() come back without it.
+int sysfs_open (const char* path, int flags);
+FILE* sysfs_fopen (const char* path, const char* mode);
+DIR* sysfs_opendir (const char* path);
+int sysfs_stat (const char* path, struct stat* st);
+int sysfs_glob (const char* pattern, int flags, int (*errfunc) (const char*, int), glob_t* results);
+
+// Send group writes and undos through the setuid pwr-helper at path, for when pwr itself can't
+// get root. The helper is started on the first write and runs until sysfs_helper_close().
+void sysfs_use_helper (const char* path);
+void sysfs_helper_close ();
+
+// Write one file through the helper. Returns 0, or -1 with errno set (ENOSYS if there's none).
+int sysfs_helper_write (const char* path, const char* value);
+
+// daemon.c - the pwrd control socket.
+
+// Runs one request, given as an argument list, and returns its exit status.
+typedef int (*daemon_handler)(int argc, char** argv);
+
+// Called whenever a watched fd becomes readable.
+typedef void (*daemon_callback)(int fd);
+
+// Have daemon_serve() call back whenever fd is readable. Returns 0, or -1 if there's no more room.
+int daemon_watch (int fd, daemon_callback ready);
+
+// Serve requests on a unix socket (or only watched fds, if path is NULL) forever.
+// Only returns (with -1) if the socket can't be set up.
+int daemon_serve (const char* path, daemon_handler handle);
+
+// Forward an argument list to a running daemon, copying its output to stdout.
+// Returns the request's exit status, or -1 if no daemon is listening.
+int daemon_request (const char* path, int argc, char** argv);
+
+// uevent.c - kernel uevents and AC adapter state.
+
+// Open a non-blocking socket receiving kernel uevents. Returns the fd, or -1.
+int uevent_open ();
+
+// Drain pending uevents, returning true if any came from one of a NULL-terminated list of subsystems.
+int uevent_read (int fd, const char* const* subsystems);
+
+// Returns 1 if any AC adapter is online, 0 if none are, and -1 if there are no adapters.
+int ac_online ();
+
+// profile.c - named sets of knob values.
+
+#define PROFILE_NAME_MAX 32
+#define PROFILE_VALUE_MAX 128  // Device allow/deny lists can get long.
+
+// Everything a profile can set.
+enum knob {
+    K_GOVERNOR,  // CPU scaling governor.
+    K_GPU,       // PRIME card, as given to prime-select.
+    K_WIFI,      // Wi-Fi power saving, on or off.
+    K_EPP,       // CPU energy_performance_preference, e.g. balance_power.
+    K_TURBO,     // CPU turbo/boost, on or off.
+    K_MIN_PERF,  // intel_pstate min_perf_pct. Each min is followed by its max.
+    K_MAX_PERF,  // intel_pstate max_perf_pct.
+    K_MIN_FREQ,  // scaling_min_freq, in kHz.
+    K_MAX_FREQ,  // scaling_max_freq, in kHz.
+    K_PCORES,    // Whether a hybrid CPU's performance cores are online, on or off.
+    K_ECORES,    // Whether its efficiency cores are online.
+    K_PCORE_MAX_FREQ,  // scaling_max_freq of the performance cores only.
+    K_ECORE_MAX_FREQ,  // And of the efficiency cores.
+    K_PCI_PM,    // PCI runtime PM (power/control), auto or on.
+    K_USB_PM,    // USB runtime PM, auto or on.
+    K_USB_AUTOSUSPEND,  // USB autosuspend_delay_ms.
+    K_SATA_LPM,  // SATA link_power_management_policy, e.g. med_power_with_dipm.
+    K_ASPM,      // pcie_aspm policy: default, performance, powersave or powersupersave.
+    K_AUDIO_PM,  // snd_hda_intel power_save timeout, in seconds (0 disables it).
+    K_PM_ALLOW,  // Devices the per-device knobs are limited to, if set.
+    K_PM_DENY,   // Devices the per-device knobs leave alone.
+    K_BG_SLICE,  // cgroup of background work, e.g. user.slice/background.slice. Followed by its
+    K_BG_CPU_MAX,     // limits, in enum cgroup_attr order.
+    K_BG_CPU_WEIGHT,
+    K_BG_CPUS,
+    K_BG_UCLAMP_MAX,
+    K_FG_SLICE,  // cgroup of interactive work, and its limits.
+    K_FG_CPU_MAX,
+    K_FG_CPU_WEIGHT,
+    K_FG_CPUS,
+    K_FG_UCLAMP_MAX,
+    K_DIRTY_WRITEBACK,  // vm.dirty_writeback_centisecs: how often the flusher threads wake up.
+    K_DIRTY_EXPIRE,     // vm.dirty_expire_centisecs: how old dirty data gets before it's written.
+    K_LAPTOP_MODE,      // vm.laptop_mode: seconds to wait after a read before writing back.
+    K_IO_SCHEDULER,     // queue/scheduler of every disk that offers it, e.g. bfq.
+    K_READ_AHEAD,       // queue/read_ahead_kb of every disk.
+    K_NVME_LATENCY,     // NVMe pm_qos_latency_tolerance_us, which limits APST power states.
+    K_REFRESH,          // Internal panel refresh rate in Hz, or max or min.
+    K_BACKLIGHT,        // Panel brightness, raw or as a percentage, e.g. 40%.
+    K_CHARGE_START,     // charge_control_start_threshold of every battery, in percent.
+    K_CHARGE_END,       // charge_control_end_threshold: where charging stops.
+    K_PLATFORM_PROFILE, // The firmware's platform_profile, e.g. low-power, balanced or performance.
+    K_TRIGGERS,  // Programs that switch to this profile while any of them runs, e.g. cc1* blender.
+    K_BATTERY_BELOW,    // Battery percentage below which monitor steps down to this profile.
+    K_COUNT
+};
+
+struct profile {
+    char name[PROFILE_NAME_MAX];
+    char value[K_COUNT][PROFILE_VALUE_MAX];  // An empty value leaves that knob alone.
+};
+
+const char* knob_name (int knob);  // The knob's name in profile files.
+
+// Look up a profile by name, (re)loading the table first if the files have changed.
+const struct profile* profile_find (const char* name);
+
+// Every profile, after the same reload check. Sets count to how many there are.
+const struct profile* profile_all (int* count);
+
+// cpu.c - driver-aware CPU frequency control.
+
+// The active cpufreq scaling driver, e.g. intel_pstate, amd-pstate-epp or acpi-cpufreq, or "".
+const char* cpu_driver ();
+
+// The sysfs attributes behind a CPU knob, found on first use.
+// Returns NULL if the running driver doesn't support that knob.
+struct sysfs_group* cpu_files (int knob);
+
+// Translate a profile value into what the knob's files expect, e.g. turbo = off to no_turbo = 1.
+const char* cpu_value (int knob, const char* value);
+
+// Returns true if a new minimum (K_MIN_PERF or K_MIN_FREQ) must wait until its maximum is written.
+int cpu_max_first (int min_knob, const char* min);
+
+// Write a hybrid CPU's performance (or efficiency) cores as a CPU list, e.g. "0-7". Returns 0,
+// or -1 if the CPU isn't hybrid.
+int cpu_core_list (int performance, char* out, size_t len);
+
+void cpu_discover ();  // Find the files behind every CPU knob up front.
+
+// gpu.c - discrete GPU runtime power management.
+
+// The sysfs directory of the discrete GPU (a display controller other than the boot one), or NULL.
+const char* gpu_discrete ();
+
+// Write control ("auto" to let it runtime-suspend, "on" to keep it powered) to the discrete GPU,
+// or with all set to every function in its slot, skipping files that already match unless force
+// is set. Returns the number of files changed, or -1 without a discrete GPU or if any file
+// couldn't be written; gpu_runtime_pm_undo() puts back the ones that were either way.
+int gpu_runtime_pm (const char* control, int all, int force);
+int gpu_runtime_pm_undo ();  // Put back what the last gpu_runtime_pm() changed.
+
+// The discrete GPU's power/runtime_status (active, suspended, ...), or NULL.
+const char* gpu_runtime_status ();
+
+// devices.c - device power management.
+
+// The files behind a device knob (K_PCI_PM to K_AUDIO_PM), or NULL if there are none.
+struct sysfs_group* device_files (int knob);
+
+// Write a device knob, except to devices left out by the allow or deny list (space-separated
+// shell patterns matching device names like 0000:00:14.0 or 1-2, or vendor:product IDs like
+// 046d:c52b; an empty list doesn't apply). Returns the number of files changed, or -1 if there
+// are none.
+int devices_apply (int knob, const char* value, const char* allow, const char* deny, int force);
+
+void devices_discover ();  // Enumerate devices up front.
+void devices_rescan ();    // Forget them, after devices come or go.
+
+// cgroup.c - CPU limits on cgroup v2 slices.
+
+// The limits a slice can have. Each slice knob is followed by one knob per limit, in this order.
+enum cgroup_attr {
+    CG_CPU_MAX,     // cpu.max, e.g. "20000 100000" for 20%.
+    CG_CPU_WEIGHT,  // cpu.weight, 1 to 10000.
+    CG_CPUSET,      // cpuset.cpus.
+    CG_UCLAMP_MAX,  // cpu.uclamp.max, as a percentage.
+    CG_COUNT
+};
+
+// The files behind one limit on every cgroup matching a glob pattern relative to /sys/fs/cgroup,
+// enabling the controller it needs on the way. Returns NULL if there are none.
+struct sysfs_group* cgroup_files (const char* slice, int attr);
+
+const char* cgroup_attr_name (int attr);  // e.g. cpu.max.
+const char* cgroup_controller (int attr); // The controller it comes with, e.g. cpu.
+
+// load.c - load, CPU pressure and temperature.
+
+#define LOAD_MAX_ZONES 16
+
+struct load_meter {
+    int stat_fd;                  // /proc/stat
+    int psi_fd;                   // /proc/pressure/cpu, or -1 without PSI.
+    int zones;
+    int zone_fd[LOAD_MAX_ZONES];  // thermal_zone*/temp
+    uint64_t total, idle;         // CPU time at the last sample, in ticks.
+};
+
+struct load_sample {
+    double busy;      // Fraction of CPU time not idle since the last sample, or -1.
+    double pressure;  // PSI "some" avg10: % of time tasks waited for a CPU, or -1.
+    double temp;      // Hottest thermal zone in degrees C, or -1.
+};
+
+int load_open (struct load_meter* m);   // Open everything. Returns 0, or -1 without /proc/stat.
+void load_sample (struct load_meter* m, struct load_sample* s);
+void load_close (struct load_meter* m);
+
+// top.c - C-state and P-state residency per CPU, and the processes that wake them most.
+
+// Open every counter and take the first sample. Returns the CPU count, or -1 with errno set
+// (ENOENT if there are no CPUs to watch).
+int top_open ();
+void top_sample ();  // Add a sample to the ring.
+
+// Print residency and wakeups over the last window samples, with up to rows processes.
+void top_report (FILE* f, int window, int rows);
+void top_close ();
+
+// energy.c - energy use from RAPL and the battery.
+
+#define ENERGY_MAX_ZONES 16
+
+// One RAPL powercap zone, e.g. package-0, core, uncore or dram.
+struct energy_zone {
+    char name[32];
+    int fd;          // energy_uj
+    uint64_t range;  // max_energy_range_uj, where the counter wraps back to zero.
+    uint64_t last;   // Last raw reading.
+    double joules;   // Energy used since energy_open().
+};
+
+struct energy_meter {
+    int zones;
+    struct energy_zone zone[ENERGY_MAX_ZONES];
+    struct timespec start;
+
+    // The first battery found. Any of these fds may be -1.
+    char battery_status[32];
+    int power_fd, current_fd, voltage_fd, energy_fd;
+    double battery_watts;   // Sum of battery power samples.
+    int battery_samples;
+    uint64_t energy_first, energy_last;
+};
+
+// Find and open every counter. Returns how many sources (zones plus battery) were found.
+int energy_open (struct energy_meter* m);
+
+// Take a sample, accumulating energy used since the last one.
+void energy_sample (struct energy_meter* m);
+
+double energy_elapsed (const struct energy_meter* m);       // Seconds since energy_open().
+double energy_battery_watts (const struct energy_meter* m); // Average battery draw, or -1.
+void energy_close (struct energy_meter* m);
+
+// storage.c - VM writeback and block-device queue settings.
+
+// The files behind a storage knob, found on first use, or NULL if there are none.
+struct sysfs_group* storage_files (int knob);
+
+// Write a storage knob, skipping disks that don't offer the scheduler asked for. Returns the
+// number of files changed, or -1 if there's nothing behind the knob.
+int storage_apply (int knob, const char* value, int force);
+
+void storage_discover ();  // Find everything now rather than at the first switch.
+void storage_rescan ();    // Forget what was found, e.g. after a disk was plugged in.
+
+// battery.c - charge thresholds, platform profile and discharge rate.
+
+struct battery_reading {
+    struct timespec at;  // CLOCK_MONOTONIC.
+    char status[32];     // Charging, Discharging, Full, Not charging, ...
+    double capacity;     // Percent, or -1.
+    double energy_wh, full_wh;  // Energy left and when full, or -1.
+    double watts;        // Instantaneous power draw, or -1.
+};
+
+// The files behind K_CHARGE_START, K_CHARGE_END or K_PLATFORM_PROFILE, or NULL if there are none.
+struct sysfs_group* battery_files (int knob);
+
+// Write a battery knob. Returns the number of files changed, -1 if there's nothing behind the
+// knob, or -2 if the firmware doesn't offer that platform profile.
+int battery_apply (int knob, const char* value, int force);
+
+const char* battery_profiles ();  // platform_profile_choices, or "".
+
+// Returns true if a new start threshold must wait until the end threshold is written.
+int battery_end_first (const char* start);
+
+int battery_read (struct battery_reading* r);  // Read the first battery. Returns 0 or -1.
+int battery_capacity ();  // Its charge left in percent, or -1.
+
+void battery_sample ();   // Add a reading to the samples the rate is worked out from.
+
+// Average discharge rate in watts over the recent samples, negative while charging. Sets span to
+// the seconds they cover, or both to 0 if there aren't enough.
+double battery_rate (double* span);
+
+// Print the status, rate and time to empty or full, from the samples if there are enough.
+void battery_report (FILE* f);
+
+// display.c - the internal panel's refresh rate and backlight.
+
+#define PWR_DISPLAY_HOOK PWR_CONFIG_DIR "/display-hook"  // Changes the refresh rate through the compositor.
+
+const char* display_panel ();  // The panel's connector, e.g. eDP-1, or NULL if there's none.
+int display_refresh ();        // Its refresh rate now, in whole Hz, or -1.
+
+// Switch the panel to the mode at its current resolution whose refresh rate is closest to value
+// (Hz, max or min). Returns 1 if it changed, 0 if it was already there, -1 on failure, or -2 if
+// another process, i.e. the compositor, is DRM master.
+int display_set_refresh (const char* value, int force);
+int display_refresh_undo ();   // Put back the mode from before the last switch. Returns 0 or -1.
+
+struct sysfs_group* backlight_files ();           // The panel's brightness file, or NULL.
+const char* backlight_value (const char* value);  // Turn a percentage into a raw brightness.
+
+void display_rescan ();  // Look for the panel again, e.g. after a GPU driver was reloaded.
+
+// spawn.c - helper programs, run with a deadline.
+
+#define SPAWN_FAILED -1   // It couldn't be started; errno says why.
+#define SPAWN_TIMEOUT -2  // It was still running at the deadline, and was killed.
+
+// Run the program at path (looked up under the root) with a NULL-terminated argv and stdin from
+// /dev/null. If out isn't NULL, up to len - 1 bytes of its output are kept there. After timeout_ms
+// it's killed, with everything it started. Returns its exit status (128 plus the signal if one
+// killed it), SPAWN_FAILED or SPAWN_TIMEOUT.
+int spawn_run (const char* path, const char* const argv[], int timeout_ms, char* out, size_t len);
+
+// The same, with the arguments listed in place and no output kept.
+#define spawn_wait(PATH, TIMEOUT_MS, ...) \
+    spawn_run(PATH, (const char* const[]){ __VA_ARGS__, NULL }, TIMEOUT_MS, NULL, 0)
+
+// caps.c - discovery results, cached across runs until boot, hotplug or a config change.
+
+#define PWR_CAPS_DIR "/run/pwr"
+#define PWR_CAPS PWR_CAPS_DIR "/caps"
+
+#define CAPS_VALUE_MAX 4096
+
+// Copy what was found under key to out. Returns 1, or 0 if it's unknown or doesn't fit.
+int caps_get (const char* key, char* out, size_t len);
+void caps_set (const char* key, const char* value);
+
+// The same for a group's paths. caps_get_group() returns 1 and fills g if the list is known.
+int caps_get_group (const char* key, struct sysfs_group* g);
+void caps_set_group (const char* key, const struct sysfs_group* g);
+
+void caps_save ();        // Write out anything new, if we're allowed to.
+void caps_invalidate ();  // Forget everything, e.g. after hotplug.
+
+// proc.c - process events from the netlink proc connector.
+
+// A process that has just started a new program, or exited.
+struct proc_change {
+    pid_t pid;
+    int exited;
+};
+
+// Subscribe to process events, which needs CAP_NET_ADMIN. Returns the socket, or -1.
+int proc_open ();
+
+// Read whatever events are pending into changes. Returns how many there were, or -1 if the
+// kernel had to drop some.
+int proc_read (int fd, struct proc_change* changes, int max);
+
+int proc_name (pid_t pid, char* out, size_t len);  // The process's comm. Returns 0 or -1.
+int proc_list (pid_t* pids, int max);              // Every process running now. Returns the count.
+int proc_matches (const char* list, const char* name); // Whether any pattern in list matches.
+
+// schedule.c - switching ahead of jobs on a timetable.
+
+#define PWR_SCHEDULE PWR_CONFIG_DIR "/schedule"
+#define SCHEDULE_MAX 32  // Most rules read from the file.
+
+// When a job starts, in bits per allowed value of each cron field, and what it wants.
+struct schedule_rule {
+    uint64_t minutes;
+    uint32_t hours;
+    uint32_t days;                   // Days of the month, 1 to 31.
+    uint16_t months;                 // 1 to 12.
+    uint8_t weekdays;                // 0 (Sunday) to 6.
+    int any_day, any_weekday;        // Whether those fields were *, for how cron combines them.
+    char profile[PROFILE_NAME_MAX];
+    int lead_s;                      // How long before the job starts to switch.
+    int for_s;                       // How long after it starts to switch back, or 0.
+    char cgroup[PROFILE_VALUE_MAX];  // The job's cgroup, under /sys/fs/cgroup; idle means done.
+    int line;                        // Where it is in the file.
+};
+
+// Read PWR_SCHEDULE into rules, reporting bad lines. Returns the count, or -1 if there's no file.
+int schedule_load (struct schedule_rule* rules, int max);
+
+// The first time after after that the job starts, or -1 if that isn't within a year.
+time_t schedule_next (const struct schedule_rule* r, time_t after);
+
+// CPU time used by everything in a cgroup so far, in microseconds, or -1 if it's gone.
+long long schedule_usage (const char* cgroup);
+
+// metrics.c - switch statistics and power readings for Prometheus.
+
+void metrics_switch (const char* profile, int ok);   // Count a switch.
+void metrics_step (const char* step, double usec);   // Record how long part of a switch took.
+
+// Take in a new power sample from m, which has to stay open. ac is ac_online() at the time.
+void metrics_power (const struct energy_meter* m, int ac);
+
+// Everything recorded so far, in the Prometheus text format, along with the current state.
+void metrics_write (FILE* f, const char* state);
+
+// The same, written atomically to a file for node_exporter's textfile collector. Returns 0 or -1.
+int metrics_save (const char* path, const char* state);
+
+#endif
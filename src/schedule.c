@@ -0,0 +1,216 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Switching ahead of jobs that start at known times, from rules in /etc/pwr/schedule.
+//
+// Each line gives when the job starts, in cron's five fields, the profile it wants and options:
+//
+//     0 2 * * *    perform  lead=90 cgroup=system.slice/nightly-build.service
+//     55 13 * * 1-5 render  lead=300 for=5400
+//
+// lead is how many seconds early to switch, so the governor and dGPU are ready when the job
+// starts. The switch lasts until the job's cgroup goes idle, or for a fixed number of seconds.
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "pwr.h"
+
+static int parse_line (char* line, struct schedule_rule* r, int number);
+// Parse one cron field into a bit per allowed value. Returns 0 or -1.
+static int parse_field (const char* field, int min, int max, uint64_t* bits);
+static int day_matches (const struct schedule_rule* r, const struct tm* tm);
+
+
+int schedule_load (struct schedule_rule* rules, int max) {
+    char line[512];
+    int count = 0;
+
+    FILE* f = sysfs_fopen(PWR_SCHEDULE, "r");
+    if (f == NULL) return -1;
+
+    for (int number = 1; fgets(line, sizeof(line), f) != NULL; number++) {
+        line[strcspn(line, "#\n")] = 0;
+        if (count == max) {
+            fprintf(stderr, "%s:%d: more than %d rules\n", PWR_SCHEDULE, number, max);
+            break;
+        }
+
+        if (parse_line(line, &rules[count], number) == 0) count++;
+    }
+
+    fclose(f);
+    return count;
+}
+
+time_t schedule_next (const struct schedule_rule* r, time_t after) {
+    struct tm tm;
+
+    // Jobs start on the minute, like cron's.
+    time_t t = (after / 60 + 1) * 60;
+    localtime_r(&t, &tm);
+
+    for (int day = 0; day < 367; day++) {
+        if (day_matches(r, &tm)) {
+            for (int h = tm.tm_hour; h < 24; h++) {
+                if (!(r->hours >> h & 1)) continue;
+
+                for (int m = h == tm.tm_hour ? tm.tm_min : 0; m < 60; m++) {
+                    if (!(r->minutes >> m & 1)) continue;
+
+                    struct tm start = tm;
+                    start.tm_hour = h;
+                    start.tm_min = m;
+                    start.tm_sec = 0;
+                    start.tm_isdst = -1;
+                    return mktime(&start);
+                }
+            }
+        }
+
+        tm.tm_mday++;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        mktime(&tm);
+    }
+
+    return -1;
+}
+
+long long schedule_usage (const char* cgroup) {
+    char path[512], line[128];
+    long long usage = -1;
+
+    // cgroup v2 keeps it in cpu.stat, in microseconds; v1's cpuacct in nanoseconds.
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/cpu.stat", cgroup);
+    FILE* f = sysfs_fopen(path, "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL && usage < 0)
+            if (!strncmp(line, "usage_usec ", 11)) usage = atoll(line + 11);
+
+        fclose(f);
+        return usage;
+    }
+
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/cpuacct/%s/cpuacct.usage", cgroup);
+    if (sysfs_read(path, line, sizeof(line)) == 0) usage = atoll(line) / 1000;
+    return usage;
+}
+
+
+static int parse_line (char* line, struct schedule_rule* r, int number) {
+    static const struct { int min, max; } ranges[5] = { { 0, 59 }, { 0, 23 }, { 1, 31 }, { 1, 12 }, { 0, 7 } };
+    uint64_t bits[5];
+    char* fields[8];
+    char* save;
+    int count = 0;
+
+    for (char* word = strtok_r(line, " \t", &save); word != NULL && count < 8; word = strtok_r(NULL, " \t", &save))
+        fields[count++] = word;
+
+    if (count == 0) return -1;
+    if (count < 6) {
+        fprintf(stderr, "%s:%d: expected five time fields and a profile\n", PWR_SCHEDULE, number);
+        return -1;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        if (parse_field(fields[i], ranges[i].min, ranges[i].max, &bits[i]) == 0) continue;
+        fprintf(stderr, "%s:%d: bad time field '%s'\n", PWR_SCHEDULE, number, fields[i]);
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->minutes = bits[0];
+    r->hours = bits[1];
+    r->days = bits[2];
+    r->months = bits[3];
+    r->weekdays = (bits[4] | bits[4] >> 7) & 0x7f;  // 7 is Sunday too.
+    r->any_day = !strcmp(fields[2], "*");
+    r->any_weekday = !strcmp(fields[4], "*");
+    r->line = number;
+
+    if (strlen(fields[5]) >= PROFILE_NAME_MAX || profile_find(fields[5]) == NULL) {
+        fprintf(stderr, "%s:%d: no profile '%s'\n", PWR_SCHEDULE, number, fields[5]);
+        return -1;
+    }
+    strcpy(r->profile, fields[5]);
+
+    for (int i = 6; i < count; i++) {
+        if (!strncmp(fields[i], "lead=", 5)) r->lead_s = atoi(fields[i] + 5);
+        else if (!strncmp(fields[i], "for=", 4)) r->for_s = atoi(fields[i] + 4);
+        else if (!strncmp(fields[i], "cgroup=", 7) && strlen(fields[i] + 7) < sizeof(r->cgroup))
+            strcpy(r->cgroup, fields[i] + 7);
+        else {
+            fprintf(stderr, "%s:%d: unknown option '%s'\n", PWR_SCHEDULE, number, fields[i]);
+            return -1;
+        }
+    }
+
+    // Without either one, nothing would ever switch back.
+    if (!r->cgroup[0] && r->for_s <= 0) {
+        fprintf(stderr, "%s:%d: needs cgroup= or for=\n", PWR_SCHEDULE, number);
+        return -1;
+    }
+
+    if (r->lead_s < 0) r->lead_s = 0;
+    return 0;
+}
+
+static int parse_field (const char* field, int min, int max, uint64_t* bits) {
+    *bits = 0;
+
+    // A list of *, N or N-M, each optionally /STEP.
+    for (const char* p = field; *p; ) {
+        int from = min, to = max, step = 1, single = 0;
+        char* end;
+
+        if (*p == '*') {
+            p++;
+        } else {
+            if (!isdigit((unsigned char)*p)) return -1;
+            from = to = strtol(p, &end, 10);
+            p = end;
+            single = 1;
+            if (*p == '-') {
+                to = strtol(p + 1, &end, 10);
+                if (end == p + 1) return -1;
+                p = end;
+                single = 0;
+            }
+        }
+
+        // Like cron, N/STEP means every STEP from N on.
+        if (*p == '/') {
+            step = strtol(p + 1, &end, 10);
+            if (end == p + 1 || step <= 0) return -1;
+            p = end;
+            if (single) to = max;
+        }
+
+        if (from < min || to > max || from > to) return -1;
+        for (int v = from; v <= to; v += step)
+            *bits |= 1ULL << v;
+
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+
+    return *bits ? 0 : -1;
+}
+
+static int day_matches (const struct schedule_rule* r, const struct tm* tm) {
+    if (!(r->months >> (tm->tm_mon + 1) & 1)) return 0;
+
+    int day = r->days >> tm->tm_mday & 1, weekday = r->weekdays >> tm->tm_wday & 1;
+
+    // As in cron, when both are restricted, either one will do.
+    if (!r->any_day && !r->any_weekday) return day || weekday;
+    return day && weekday;
+}
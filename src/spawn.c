@@ -0,0 +1,172 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+#define _GNU_SOURCE  // pipe2()
+
+// Helper programs (prime-select, systemctl, iwconfig, the display hook), run with a deadline.
+//
+// posix_spawn() starts them without copying pwrd's page tables the way fork() would, and
+// reports a failed exec to us instead of leaving a copy of pwr running in the child. Each child
+// gets its own process group, so a timeout takes down whatever it started too. Exits are
+// waited for through a pidfd in an epoll set along with the child's output, so a hung helper
+// costs its timeout and no more. Backends run in their own threads and each call has its own
+// epoll set, so helpers for different backends run side by side.
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pwr.h"
+
+extern char** environ;
+
+// Without pidfds (before Linux 5.3), how often to look for the exit instead.
+#define POLL_MS 10
+
+static int pidfd_open_ (pid_t pid);
+static long ms_left (const struct timespec* deadline);
+
+// Wait for the child to exit, collecting its output, until the deadline. Returns its wait
+// status, or -1 if it's still running.
+static int supervise (pid_t pid, int output, int timeout_ms, char* out, size_t len);
+
+
+int spawn_run (const char* path, const char* const argv[], int timeout_ms, char* out, size_t len) {
+    char real[PATH_MAX];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int pipes[2] = { -1, -1 };
+    pid_t pid;
+
+    if (out != NULL && pipe2(pipes, O_CLOEXEC) < 0) return SPAWN_FAILED;
+
+    // Nothing should ever wait on a prompt; polkit asking for a password would otherwise hang us.
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (out != NULL) posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    int error = posix_spawn(&pid, sysfs_path(path, real, sizeof(real)), &actions, &attr, (char* const*)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (pipes[1] >= 0) close(pipes[1]);
+
+    if (error) {
+        if (pipes[0] >= 0) close(pipes[0]);
+        errno = error;
+        return SPAWN_FAILED;
+    }
+
+    int status = supervise(pid, pipes[0], timeout_ms, out, len);
+    if (pipes[0] >= 0) close(pipes[0]);
+
+    if (status < 0) {
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return SPAWN_TIMEOUT;
+    }
+
+    // The same numbers a shell would give.
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+
+static int pidfd_open_ (pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static long ms_left (const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+static int supervise (pid_t pid, int output, int timeout_ms, char* out, size_t len) {
+    struct epoll_event events[2], ev = { .events = EPOLLIN };
+    struct timespec deadline;
+    char discard[256];
+    size_t got = 0;
+    int status = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int pidfd = pidfd_open_(pid);
+
+    if (epoll >= 0 && pidfd >= 0) {
+        ev.data.fd = pidfd;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, pidfd, &ev);
+    }
+
+    if (epoll >= 0 && output >= 0) {
+        fcntl(output, F_SETFL, O_NONBLOCK);
+        ev.data.fd = output;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, output, &ev);
+    }
+
+    for (long left; status < 0 && (left = ms_left(&deadline)) > 0; ) {
+        int wait = pidfd < 0 && left > POLL_MS ? POLL_MS : left;
+        int n = epoll >= 0 ? epoll_wait(epoll, events, 2, wait) : poll(NULL, 0, wait);
+        if (n < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd != output) continue;
+
+            // Keep what fits; the rest is read and dropped so the child never blocks on a full pipe.
+            ssize_t r;
+            do {
+                int keep = got + 1 < len;
+                r = read(output, keep ? out + got : discard, keep ? len - 1 - got : sizeof(discard));
+                if (r > 0 && keep) got += r;
+            } while (r > 0);
+
+            if (r == 0 || (r < 0 && errno != EAGAIN)) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, output, NULL);
+                output = -1;
+            }
+        }
+
+        if (waitpid(pid, &status, WNOHANG) != pid) status = -1;
+    }
+
+    // Whatever it wrote just before exiting is still in the pipe.
+    if (status >= 0 && output >= 0) {
+        ssize_t r;
+        while (got + 1 < len && (r = read(output, out + got, len - 1 - got)) > 0)
+            got += r;
+    }
+
+    if (out != NULL && len > 0) out[got] = 0;
+    if (pidfd >= 0) close(pidfd);
+    if (epoll >= 0) close(epoll);
+    return status;
+}
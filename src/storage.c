@@ -0,0 +1,127 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// VM writeback and block-device settings: how long dirty pages may wait and how the disks queue.
+//
+// Like devices.c, everything is found once and kept open until storage_rescan(). Only real
+// disks count; loop, zram and device-mapper devices have no device link in /sys/block.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+static struct sysfs_group files[K_COUNT];
+static char (*schedulers)[SYSFS_VALUE_MAX];  // What each disk's scheduler file offers.
+static int enumerated = 0;
+
+static void enumerate ();
+static void add_file (int knob, const char* path);
+static int offers (const char* available, const char* scheduler);
+
+
+struct sysfs_group* storage_files (int knob) {
+    if (!enumerated) enumerate();
+    return files[knob].count ? &files[knob] : NULL;
+}
+
+int storage_apply (int knob, const char* value, int force) {
+    struct sysfs_group* g = storage_files(knob);
+    if (g == NULL) return -1;
+
+    // Not every disk has every scheduler; the ones that don't keep theirs.
+    for (int i = 0; i < g->count; i++)
+        g->skip[i] = knob == K_IO_SCHEDULER && !offers(schedulers[i], value);
+
+    sysfs_group_write(g, value, PWR_MAX_THREADS, force);
+
+    int changed = 0;
+    for (int i = 0; i < g->count; i++)
+        changed += g->changed[i] && !g->errors[i];
+
+    return changed;
+}
+
+void storage_discover () {
+    if (!enumerated) enumerate();
+}
+
+void storage_rescan () {
+    for (int k = 0; k < K_COUNT; k++)
+        sysfs_group_free(&files[k]);
+
+    free(schedulers);
+    schedulers = NULL;
+    enumerated = 0;
+}
+
+
+static void enumerate () {
+    char path[512];
+    struct stat st;
+
+    enumerated = 1;
+
+    add_file(K_DIRTY_WRITEBACK, "/proc/sys/vm/dirty_writeback_centisecs");
+    add_file(K_DIRTY_EXPIRE, "/proc/sys/vm/dirty_expire_centisecs");
+    add_file(K_LAPTOP_MODE, "/proc/sys/vm/laptop_mode");
+
+    DIR* d = sysfs_opendir("/sys/block");
+    if (d != NULL) {
+        for (struct dirent* ent; (ent = readdir(d)) != NULL; ) {
+            snprintf(path, sizeof(path), "/sys/block/%s/device", ent->d_name);
+            if (ent->d_name[0] == '.' || sysfs_stat(path, &st) < 0) continue;
+
+            snprintf(path, sizeof(path), "/sys/block/%s/queue/scheduler", ent->d_name);
+            add_file(K_IO_SCHEDULER, path);
+            snprintf(path, sizeof(path), "/sys/block/%s/queue/read_ahead_kb", ent->d_name);
+            add_file(K_READ_AHEAD, path);
+        }
+
+        closedir(d);
+    }
+
+    // The latency NVMe controllers may add by entering deeper power states (APST).
+    d = sysfs_opendir("/sys/class/nvme");
+    if (d != NULL) {
+        for (struct dirent* ent; (ent = readdir(d)) != NULL; ) {
+            if (ent->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "/sys/class/nvme/%s/power/pm_qos_latency_tolerance_us", ent->d_name);
+            add_file(K_NVME_LATENCY, path);
+        }
+
+        closedir(d);
+    }
+}
+
+static void add_file (int knob, const char* path) {
+    char value[SYSFS_VALUE_MAX];
+
+    // Schedulers read back as every choice, e.g. "none [mq-deadline] kyber bfq".
+    if (sysfs_read(path, value, sizeof(value)) < 0) return;
+
+    int i = sysfs_group_add(&files[knob], path);
+    if (knob != K_IO_SCHEDULER) return;
+
+    schedulers = realloc(schedulers, files[knob].count * sizeof(*schedulers));
+    snprintf(schedulers[i], sizeof(schedulers[i]), "%s", value);
+}
+
+static int offers (const char* available, const char* scheduler) {
+    size_t len = strlen(scheduler);
+
+    for (const char* p = available; (p = strstr(p, scheduler)) != NULL; p += len) {
+        int start = p == available || p[-1] == ' ' || p[-1] == '[';
+        int end = p[len] == ' ' || p[len] == ']' || p[len] == 0;
+        if (start && end) return 1;
+    }
+
+    return 0;
+}
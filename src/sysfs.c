@@ -0,0 +1,474 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Batched writes to groups of sysfs attributes, keeping their fds open between writes, and the
+// root every system path is looked up under.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <dirent.h>
+#include <glob.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "pwr.h"
+
+// Shared state for one sysfs_group_write() call.
+struct write_job {
+    struct sysfs_group* group;
+    const char* value;
+    size_t len;
+    int force;            // Write even if the attribute already holds the value.
+    int next;             // Next index to be claimed by a worker.
+    int failed;           // Number of writes that failed.
+    int error;            // errno of the last failed write.
+    pthread_mutex_t lock;
+};
+
+// Prepended to every system path; empty for the real system.
+static char root[PATH_MAX] = "";
+static size_t root_len = 0;
+
+// The pwr-helper process, shared by every backend's thread; one batch is in flight at a time.
+static struct {
+    const char* path;
+    pid_t pid;
+    int fd;
+    FILE* replies;
+    pthread_mutex_t lock;
+} helper = { .pid = -1, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void* write_worker (void* arg);      // Claim and perform writes until none are left.
+static int write_one (struct sysfs_group* g, int i, const char* value, size_t len, int force);
+static int put (int fd, const char* line, size_t len);  // pwrite() a whole value. Returns 0 or -1.
+static int helper_group_write (struct sysfs_group* g, const char* value, int force);
+static int helper_group_undo (struct sysfs_group* g);
+static int helper_start ();
+// Send one batch and wait for its results. Returns the number of writes that failed.
+static int helper_batch (char** paths, const char** values, int count, int* errors);
+static void selected (char* value);         // Reduce a choice attribute like "a [b] c" to "b".
+
+
+int sysfs_group_glob (struct sysfs_group* g, const char* pattern) {
+    glob_t results = { 0 };
+
+    memset(g, 0, sizeof(*g));
+    if (sysfs_glob(pattern, 0, glob_error, &results) != 0) {
+        globfree(&results);
+        return 0;
+    }
+
+    for (size_t i = 0; i < results.gl_pathc; i++)
+        sysfs_group_add(g, results.gl_pathv[i]);
+
+    globfree(&results);
+    return g->count;
+}
+
+int sysfs_group_add (struct sysfs_group* g, const char* path) {
+    int i = g->count++;
+
+    g->paths = realloc(g->paths, g->count * sizeof(char*));
+    g->fds = realloc(g->fds, g->count * sizeof(int));
+    g->usec = realloc(g->usec, g->count * sizeof(double));
+    g->changed = realloc(g->changed, g->count * sizeof(int));
+    g->errors = realloc(g->errors, g->count * sizeof(int));
+    g->skip = realloc(g->skip, g->count * sizeof(int));
+    g->saved = realloc(g->saved, g->count * sizeof(*g->saved));
+
+    g->paths[i] = strdup(path);
+    g->fds[i] = -1;
+    g->usec[i] = 0;
+    g->changed[i] = 0;
+    g->errors[i] = 0;
+    g->skip[i] = 0;
+    g->saved[i][0] = 0;
+    return i;
+}
+
+int sysfs_group_write (struct sysfs_group* g, const char* value, int threads, int force) {
+    char line[SYSFS_VALUE_MAX + 1];
+    struct write_job job = { .group = g, .value = line, .force = force };
+
+    if (helper.path != NULL) return helper_group_write(g, value, force);
+
+    job.len = snprintf(line, sizeof(line), "%s\n", value);
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (threads > g->count) threads = g->count;
+    if (threads > PWR_MAX_THREADS) threads = PWR_MAX_THREADS;
+
+    // Each write to e.g. a governor makes the kernel stop and restart it, so spread them out.
+    pthread_t workers[PWR_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++)
+        if (pthread_create(&workers[started], NULL, write_worker, &job) == 0) started++;
+
+    write_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    if (job.failed) errno = job.error;
+    return job.failed;
+}
+
+int sysfs_group_undo (struct sysfs_group* g) {
+    char line[SYSFS_VALUE_MAX + 1];
+    int failed = 0;
+
+    if (helper.path != NULL) return helper_group_undo(g);
+
+    // Only what the last write actually changed; the rest never left its old value.
+    for (int i = 0; i < g->count; i++) {
+        if (!g->changed[i] || g->errors[i]) continue;
+        g->changed[i] = 0;
+
+        // An empty value goes back too: an empty cpuset.cpus means all of the parent's CPUs.
+        size_t len = snprintf(line, sizeof(line), "%s\n", g->saved[i]);
+        if (put(g->fds[i], line, len) < 0) failed++;
+    }
+
+    return failed;
+}
+
+int sysfs_read (const char* path, char* out, size_t len) {
+    int fd = sysfs_open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t got = read(fd, out, len - 1);
+    close(fd);
+    if (got < 0) return -1;
+
+    out[got] = 0;
+    out[strcspn(out, "\n")] = 0;
+    return 0;
+}
+
+void sysfs_set_root (const char* path) {
+    snprintf(root, sizeof(root), "%s", path);
+
+    // The paths given to everything else all start with a slash of their own.
+    root_len = strlen(root);
+    while (root_len > 0 && root[root_len - 1] == '/') root[--root_len] = 0;
+}
+
+const char* sysfs_root () {
+    return root;
+}
+
+const char* sysfs_path (const char* path, char* out, size_t len) {
+    if (!root_len) return path;
+    snprintf(out, len, "%s%s", root, path);
+    return out;
+}
+
+int sysfs_open (const char* path, int flags) {
+    char real[PATH_MAX];
+    return open(sysfs_path(path, real, sizeof(real)), flags, 0644);
+}
+
+FILE* sysfs_fopen (const char* path, const char* mode) {
+    char real[PATH_MAX];
+    return fopen(sysfs_path(path, real, sizeof(real)), mode);
+}
+
+DIR* sysfs_opendir (const char* path) {
+    char real[PATH_MAX];
+    return opendir(sysfs_path(path, real, sizeof(real)));
+}
+
+int sysfs_stat (const char* path, struct stat* st) {
+    char real[PATH_MAX];
+    return stat(sysfs_path(path, real, sizeof(real)), st);
+}
+
+int sysfs_glob (const char* pattern, int flags, int (*errfunc) (const char*, int), glob_t* results) {
+    char real[PATH_MAX];
+    int result = glob(sysfs_path(pattern, real, sizeof(real)), flags, errfunc, results);
+
+    // Matches come back as the paths everything else expects, without the root.
+    for (size_t i = 0; result == 0 && root_len && i < results->gl_pathc; i++) {
+        char* match = results->gl_pathv[i];
+        memmove(match, match + root_len, strlen(match + root_len) + 1);
+    }
+
+    return result;
+}
+
+void sysfs_use_helper (const char* path) {
+    helper.path = path;
+}
+
+void sysfs_helper_close () {
+    pthread_mutex_lock(&helper.lock);
+
+    // The helper exits once its input runs out.
+    if (helper.pid > 0) {
+        fclose(helper.replies);
+        close(helper.fd);
+        waitpid(helper.pid, NULL, 0);
+    }
+
+    helper.pid = -1;
+    helper.fd = -1;
+    helper.path = NULL;
+    pthread_mutex_unlock(&helper.lock);
+}
+
+int sysfs_helper_write (const char* path, const char* value) {
+    int error;
+
+    if (helper.path == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (helper_batch((char**)&path, &value, 1, &error) == 0) return 0;
+    errno = error;
+    return -1;
+}
+
+void sysfs_group_free (struct sysfs_group* g) {
+    for (int i = 0; i < g->count; i++) {
+        if (g->fds[i] >= 0) close(g->fds[i]);
+        free(g->paths[i]);
+    }
+
+    free(g->paths);
+    free(g->fds);
+    free(g->usec);
+    free(g->changed);
+    free(g->errors);
+    free(g->skip);
+    free(g->saved);
+    memset(g, 0, sizeof(*g));
+}
+
+
+static void* write_worker (void* arg) {
+    struct write_job* job = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (i >= job->group->count) return NULL;
+
+        job->group->errors[i] = 0;
+        if (job->group->skip[i]) {
+            job->group->changed[i] = 0;
+            continue;
+        }
+
+        if (write_one(job->group, i, job->value, job->len, job->force) < 0) {
+            job->group->errors[i] = errno;
+            pthread_mutex_lock(&job->lock);
+            job->failed++;
+            job->error = errno;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+}
+
+static int write_one (struct sysfs_group* g, int i, const char* value, size_t len, int force) {
+    struct timespec start, end;
+    char current[SYSFS_VALUE_MAX];
+    int ok = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (g->fds[i] < 0) g->fds[i] = sysfs_open(g->paths[i], O_RDWR | O_CLOEXEC);
+    if (g->fds[i] < 0) g->fds[i] = sysfs_open(g->paths[i], O_WRONLY | O_CLOEXEC);
+
+    // Reading is far cheaper than a write that makes the kernel reconfigure something, and the
+    // old value is needed to undo the write anyway. value ends in a newline; current doesn't.
+    ssize_t got = g->fds[i] >= 0 ? pread(g->fds[i], current, sizeof(current) - 1, 0) : -1;
+    current[got > 0 ? got : 0] = 0;
+    selected(current);
+
+    g->changed[i] = force || strlen(current) != len - 1 || memcmp(current, value, len - 1);
+    if (g->changed[i]) memcpy(g->saved[i], current, sizeof(current));
+
+    if (g->changed[i])
+        ok = g->fds[i] >= 0 && put(g->fds[i], value, len) == 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    g->usec[i] = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+
+    return ok ? 0 : -1;
+}
+
+static int put (int fd, const char* line, size_t len) {
+    if (pwrite(fd, line, len, 0) != (ssize_t)len) return -1;
+
+    // An attribute always holds exactly what was last written; a plain file in a fake tree
+    // would keep the tail of a longer value.
+    if (root_len) ftruncate(fd, len);
+    return 0;
+}
+
+static int helper_group_write (struct sysfs_group* g, const char* value, int force) {
+    char** paths = malloc(g->count * sizeof(char*));
+    const char** values = malloc(g->count * sizeof(char*));
+    int* errors = malloc(g->count * sizeof(int));
+    int* index = malloc(g->count * sizeof(int));
+    char current[SYSFS_VALUE_MAX];
+    struct timespec start, end;
+    int count = 0, failed = 0;
+
+    // Working out what changes needs no privileges, so it stays here; the helper only writes.
+    for (int i = 0; i < g->count; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        g->errors[i] = 0;
+        g->changed[i] = 0;
+        if (g->skip[i]) continue;
+
+        if (g->fds[i] < 0) g->fds[i] = sysfs_open(g->paths[i], O_RDONLY | O_CLOEXEC);
+        ssize_t got = g->fds[i] >= 0 ? pread(g->fds[i], current, sizeof(current) - 1, 0) : -1;
+        current[got > 0 ? got : 0] = 0;
+        selected(current);
+
+        g->changed[i] = force || strcmp(current, value);
+        if (g->changed[i]) {
+            memcpy(g->saved[i], current, sizeof(current));
+            paths[count] = g->paths[i];
+            values[count] = value;
+            index[count++] = i;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        g->usec[i] = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    }
+
+    if (count) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        failed = helper_batch(paths, values, count, errors);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        // The batch is timed as a whole, so each write gets its share.
+        double usec = ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3) / count;
+        for (int j = 0; j < count; j++) {
+            g->errors[index[j]] = errors[j];
+            g->usec[index[j]] += usec;
+            if (errors[j]) errno = errors[j];
+        }
+    }
+
+    free(paths);
+    free(values);
+    free(errors);
+    free(index);
+    return failed;
+}
+
+static int helper_group_undo (struct sysfs_group* g) {
+    char** paths = malloc(g->count * sizeof(char*));
+    const char** values = malloc(g->count * sizeof(char*));
+    int* errors = malloc(g->count * sizeof(int));
+    int count = 0, failed = 0;
+
+    for (int i = 0; i < g->count; i++) {
+        if (!g->changed[i] || g->errors[i]) continue;
+        g->changed[i] = 0;
+        paths[count] = g->paths[i];
+        values[count++] = g->saved[i];
+    }
+
+    if (count) failed = helper_batch(paths, values, count, errors);
+
+    free(paths);
+    free(values);
+    free(errors);
+    return failed;
+}
+
+static int helper_start () {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) return -1;
+
+    helper.pid = fork();
+    if (helper.pid == 0) {
+        char* argv[] = { "pwr-helper", NULL };
+        char* envp[] = { NULL };
+
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        execve(helper.path, argv, envp);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    if (helper.pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    helper.fd = fds[0];
+    helper.replies = fdopen(fcntl(fds[0], F_DUPFD_CLOEXEC, 0), "r");
+    return 0;
+}
+
+static int helper_batch (char** paths, const char** values, int count, int* errors) {
+    char* batch = NULL;
+    size_t len = 0;
+    int failed = 0, sent = 0;
+
+    FILE* f = open_memstream(&batch, &len);
+    for (int i = 0; i < count; i++)
+        fprintf(f, "%s %s\n", paths[i], values[i]);
+    fputc('\n', f);
+    fclose(f);
+
+    pthread_mutex_lock(&helper.lock);
+
+    // MSG_NOSIGNAL, so a helper that failed to start shows up as errors rather than SIGPIPE.
+    if (helper.pid > 0 || helper_start() == 0) {
+        size_t done = 0;
+        for (ssize_t n; done < len && (n = send(helper.fd, batch + done, len - done, MSG_NOSIGNAL)) > 0; )
+            done += n;
+        sent = done == len;
+    }
+
+    char* reply = NULL;
+    size_t size = 0;
+    char* p = sent && getline(&reply, &size, helper.replies) > 0 ? reply : NULL;
+
+    for (int i = 0; i < count; i++) {
+        char* end = NULL;
+        errors[i] = p != NULL ? (int)strtol(p, &end, 10) : EIO;
+        if (p != NULL && end == p) errors[i] = EIO;
+        if (p != NULL) p = end;
+        failed += errors[i] != 0;
+    }
+
+    pthread_mutex_unlock(&helper.lock);
+    free(reply);
+    free(batch);
+    return failed;
+}
+
+static void selected (char* value) {
+    value[strcspn(value, "\n")] = 0;
+
+    char* start = strchr(value, '[');
+    char* end = start ? strchr(start, ']') : NULL;
+    if (end == NULL) return;
+
+    *end = 0;
+    memmove(value, start + 1, end - start);
+}
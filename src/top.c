@@ -0,0 +1,476 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Where the CPUs spend their time, and which processes keep waking them, for pwr top.
+//
+// Every counter file is opened once and re-read with pread(): cpuidle state times, cpufreq
+// time_in_state (or scaling_cur_freq where the driver keeps no stats, like intel_pstate in
+// active mode), and each thread's schedstat. Samples go into a ring, so a report covers the
+// last few intervals without keeping copies of anything. Threads are found by walking /proc,
+// which lists them in pid order, so the table is merged in one pass each sample rather than
+// searched; apart from new threads, a sample allocates nothing.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "pwr.h"
+
+#define TOP_MAX_STATES 12
+#define TOP_MAX_FREQS 64
+#define TOP_SAMPLES 16
+
+struct cpu {
+    int id;
+    int states;
+    int idle_fd[TOP_MAX_STATES];   // cpuidle/state*/time, in microseconds.
+    int policy;                    // Index into policies, or -1 without cpufreq.
+};
+
+struct policy {
+    ino_t inode;                   // Of the policy directory, so shared ones are read once.
+    int stats_fd;                  // stats/time_in_state, or -1.
+    int cur_fd;                    // scaling_cur_freq, or -1.
+    int freqs;
+    unsigned freq[TOP_MAX_FREQS];  // kHz, in time_in_state order.
+};
+
+struct task {
+    pid_t tgid, tid;
+    int fd;                        // /proc/TGID/task/TID/schedstat
+    long born;                     // The first sample it was seen in.
+    uint64_t runs[TOP_SAMPLES];    // Times it was scheduled in, per ring slot.
+    uint64_t ns[TOP_SAMPLES];      // Time spent running.
+    char comm[16];
+};
+
+// One ring slot's worth of CPU counters.
+struct snapshot {
+    struct timespec at;
+    uint64_t* idle;                // cpus * TOP_MAX_STATES, microseconds.
+    uint64_t* ticks;               // policies * TOP_MAX_FREQS, 10 ms units.
+    uint64_t* cur;                 // policies, kHz.
+};
+
+static struct cpu* cpus;
+static struct policy* policies;
+static int cpu_count, policy_count;
+static char state_names[TOP_MAX_STATES][16];  // The first CPU's; the others normally match.
+static int state_count;
+
+static struct snapshot ring[TOP_SAMPLES];
+static long taken = 0;             // Samples so far.
+
+static struct task* tasks;         // Sorted by tgid, then tid, as /proc lists them.
+static struct task* spare;         // The other buffer for merging into.
+static int task_count, task_max;
+
+static void open_cpu (int id);
+static int open_policy (const char* dir);
+static void sample_tasks (int slot);
+// Add a thread to the spare table during a merge, reusing the old entry if it was known.
+static void keep_task (int* n, struct task* old, pid_t tgid, pid_t tid, int slot);
+static int read_schedstat (struct task* t, int slot);
+static ssize_t read_at (int fd, char* buf, size_t len);
+static double between (const struct timespec* a, const struct timespec* b);
+static int numeric (const char* name);
+
+
+int top_open () {
+    char path[64];
+    struct stat st;
+
+    // Offline CPUs are skipped; they have nothing to report until they come back.
+    for (int id = 0; ; id++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", id);
+        if (sysfs_stat(path, &st) < 0) break;
+        open_cpu(id);
+    }
+
+    if (cpu_count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (int i = 0; i < TOP_SAMPLES; i++) {
+        ring[i].idle = calloc((size_t)cpu_count * TOP_MAX_STATES, sizeof(uint64_t));
+        ring[i].ticks = calloc((size_t)policy_count * TOP_MAX_FREQS + 1, sizeof(uint64_t));
+        ring[i].cur = calloc((size_t)policy_count + 1, sizeof(uint64_t));
+        if (ring[i].idle == NULL || ring[i].ticks == NULL || ring[i].cur == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    top_sample();
+    return cpu_count;
+}
+
+void top_sample () {
+    char buf[4096];
+    int slot = taken % TOP_SAMPLES;
+    struct snapshot* s = &ring[slot];
+
+    clock_gettime(CLOCK_MONOTONIC, &s->at);
+
+    for (int c = 0; c < cpu_count; c++)
+        for (int i = 0; i < cpus[c].states; i++)
+            if (read_at(cpus[c].idle_fd[i], buf, sizeof(buf)) > 0)
+                s->idle[c * TOP_MAX_STATES + i] = strtoull(buf, NULL, 10);
+
+    for (int p = 0; p < policy_count; p++) {
+        struct policy* pol = &policies[p];
+
+        // "800000 12345\n1000000 678\n...": each frequency and the time spent there.
+        if (pol->stats_fd >= 0 && read_at(pol->stats_fd, buf, sizeof(buf)) > 0) {
+            char* line = buf;
+            for (int f = 0; f < pol->freqs && *line; f++) {
+                strtoul(line, &line, 10);
+                s->ticks[p * TOP_MAX_FREQS + f] = strtoull(line, &line, 10);
+                while (*line == '\n') line++;
+            }
+        }
+
+        if (pol->cur_fd >= 0 && read_at(pol->cur_fd, buf, sizeof(buf)) > 0) s->cur[p] = strtoull(buf, NULL, 10);
+    }
+
+    sample_tasks(slot);
+    taken++;
+}
+
+void top_report (FILE* f, int window, int rows) {
+    if (taken < 2) return;
+
+    // Compare the newest sample with the oldest one in the window still in the ring.
+    if (window >= taken) window = taken - 1;
+    if (window >= TOP_SAMPLES) window = TOP_SAMPLES - 1;
+
+    long newest = taken - 1, oldest = taken - 1 - window;
+    const struct snapshot* a = &ring[oldest % TOP_SAMPLES];
+    const struct snapshot* b = &ring[newest % TOP_SAMPLES];
+    double seconds = between(&a->at, &b->at);
+    if (seconds <= 0) return;
+
+    fprintf(f, "%d CPUs, last %.1f s\n", cpu_count, seconds);
+    fprintf(f, "%4s %7s %6s %15s", "CPU", "active", "MHz", "top P-state");
+    for (int i = 0; i < state_count; i++)
+        fprintf(f, " %7.7s", state_names[i]);
+    fputc('\n', f);
+
+    for (int c = 0; c < cpu_count; c++) {
+        const struct cpu* cpu = &cpus[c];
+        double idle = 0, share[TOP_MAX_STATES];
+
+        for (int i = 0; i < cpu->states; i++) {
+            int k = c * TOP_MAX_STATES + i;
+            share[i] = (b->idle[k] - a->idle[k]) / (seconds * 1e4);
+            idle += share[i];
+        }
+
+        fprintf(f, "%4d", cpu->id);
+        if (cpu->states) fprintf(f, " %6.1f%%", idle < 100 ? 100 - idle : 0.0);
+        else fprintf(f, " %7s", "-");
+
+        // time_in_state gives the whole distribution; without it, the samples' average.
+        const struct policy* pol = cpu->policy >= 0 ? &policies[cpu->policy] : NULL;
+        double khz = 0, total = 0, top_ticks = 0;
+        unsigned top = 0;
+
+        if (pol != NULL && pol->stats_fd >= 0) {
+            for (int i = 0; i < pol->freqs; i++) {
+                int k = cpu->policy * TOP_MAX_FREQS + i;
+                double ticks = b->ticks[k] - a->ticks[k];
+                khz += ticks * pol->freq[i];
+                total += ticks;
+                if (ticks > top_ticks) {
+                    top_ticks = ticks;
+                    top = pol->freq[i];
+                }
+            }
+
+            if (total > 0) khz /= total;
+        } else if (pol != NULL && pol->cur_fd >= 0) {
+            for (long n = oldest + 1; n <= newest; n++)
+                khz += ring[n % TOP_SAMPLES].cur[cpu->policy];
+            khz /= window;
+        }
+
+        if (khz > 0) fprintf(f, " %6.0f", khz / 1000);
+        else fprintf(f, " %6s", "-");
+
+        if (top) fprintf(f, " %5u MHz %4.0f%%", top / 1000, 100 * top_ticks / total);
+        else fprintf(f, " %15s", "-");
+
+        for (int i = 0; i < state_count; i++) {
+            if (i < cpu->states) fprintf(f, " %6.1f%%", share[i]);
+            else fprintf(f, " %7s", "-");
+        }
+
+        fputc('\n', f);
+    }
+
+    // Threads are added up per process; the table is already grouped that way.
+    struct { pid_t pid; const char* comm; double wakeups, cpu; } top[32];
+    int shown = 0;
+    if (rows > 32) rows = 32;
+
+    for (int i = 0; i < task_count; ) {
+        pid_t pid = tasks[i].tgid;
+        const char* comm = tasks[i].comm;
+        double runs = 0, ns = 0;
+
+        for (; i < task_count && tasks[i].tgid == pid; i++) {
+            const struct task* t = &tasks[i];
+            long from = t->born > oldest ? t->born : oldest;
+            if (from >= newest) continue;
+
+            runs += t->runs[newest % TOP_SAMPLES] - t->runs[from % TOP_SAMPLES];
+            ns += t->ns[newest % TOP_SAMPLES] - t->ns[from % TOP_SAMPLES];
+        }
+
+        if (runs <= 0) continue;
+
+        // Insertion into the few rows that are shown, busiest waker first.
+        int at = shown < rows ? shown++ : rows;
+        while (at > 0 && top[at - 1].wakeups < runs / seconds) {
+            if (at < rows) top[at] = top[at - 1];
+            at--;
+        }
+
+        if (at < rows) {
+            top[at].pid = pid;
+            top[at].comm = comm;
+            top[at].wakeups = runs / seconds;
+            top[at].cpu = ns / (seconds * 1e7);
+        }
+    }
+
+    if (shown == 0) return;
+
+    fprintf(f, "\n%7s %-16s %10s %7s\n", "PID", "process", "wakeups/s", "CPU");
+    for (int i = 0; i < shown; i++)
+        fprintf(f, "%7d %-16s %10.1f %6.1f%%\n", (int)top[i].pid, top[i].comm, top[i].wakeups, top[i].cpu);
+}
+
+void top_close () {
+    for (int c = 0; c < cpu_count; c++)
+        for (int i = 0; i < cpus[c].states; i++)
+            close(cpus[c].idle_fd[i]);
+
+    for (int p = 0; p < policy_count; p++) {
+        if (policies[p].stats_fd >= 0) close(policies[p].stats_fd);
+        if (policies[p].cur_fd >= 0) close(policies[p].cur_fd);
+    }
+
+    for (int i = 0; i < task_count; i++)
+        if (tasks[i].fd >= 0) close(tasks[i].fd);
+
+    for (int i = 0; i < TOP_SAMPLES; i++) {
+        free(ring[i].idle);
+        free(ring[i].ticks);
+        free(ring[i].cur);
+    }
+
+    free(cpus);
+    free(policies);
+    free(tasks);
+    free(spare);
+    memset(ring, 0, sizeof(ring));
+    cpus = NULL;
+    policies = NULL;
+    tasks = spare = NULL;
+    cpu_count = policy_count = state_count = task_count = task_max = 0;
+    taken = 0;
+}
+
+
+static void open_cpu (int id) {
+    char path[128], name[16];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/online", id);
+    if (sysfs_read(path, name, sizeof(name)) == 0 && name[0] == '0') return;
+
+    cpus = realloc(cpus, (cpu_count + 1) * sizeof(*cpus));
+    struct cpu* cpu = &cpus[cpu_count++];
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->id = id;
+
+    for (int i = 0; i < TOP_MAX_STATES; i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/time", id, i);
+        int fd = sysfs_open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) break;
+
+        cpu->idle_fd[cpu->states++] = fd;
+        if (cpu_count > 1) continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", id, i);
+        if (sysfs_read(path, state_names[i], sizeof(state_names[i])) < 0)
+            snprintf(state_names[i], sizeof(state_names[i]), "state%d", i);
+        state_count = cpu->states;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq", id);
+    cpu->policy = open_policy(path);
+}
+
+static int open_policy (const char* dir) {
+    char path[160], buf[4096];
+    struct stat st;
+
+    // CPUs that share a policy link to the same directory.
+    if (sysfs_stat(dir, &st) < 0) return -1;
+    for (int p = 0; p < policy_count; p++)
+        if (policies[p].inode == st.st_ino) return p;
+
+    policies = realloc(policies, (policy_count + 1) * sizeof(*policies));
+    struct policy* pol = &policies[policy_count];
+    memset(pol, 0, sizeof(*pol));
+    pol->inode = st.st_ino;
+
+    snprintf(path, sizeof(path), "%s/stats/time_in_state", dir);
+    pol->stats_fd = sysfs_open(path, O_RDONLY | O_CLOEXEC);
+    if (pol->stats_fd >= 0 && read_at(pol->stats_fd, buf, sizeof(buf)) > 0) {
+        for (char* line = buf; *line && pol->freqs < TOP_MAX_FREQS; ) {
+            pol->freq[pol->freqs++] = strtoul(line, &line, 10);
+            strtoull(line, &line, 10);
+            while (*line == '\n') line++;
+        }
+    }
+
+    // Drivers without stats (intel_pstate, amd-pstate) leave an empty file or none at all.
+    if (pol->stats_fd >= 0 && pol->freqs == 0) {
+        close(pol->stats_fd);
+        pol->stats_fd = -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/scaling_cur_freq", dir);
+    pol->cur_fd = pol->stats_fd < 0 ? sysfs_open(path, O_RDONLY | O_CLOEXEC) : -1;
+    return policy_count++;
+}
+
+static void sample_tasks (int slot) {
+    char path[64];
+    int n = 0, old = 0;
+
+    DIR* proc = sysfs_opendir("/proc");
+    if (proc == NULL) return;
+
+    // readdir() gives pids in increasing order, and tasks in increasing order within them, so
+    // walking the old table alongside says which threads are new and which have gone.
+    for (struct dirent* ent; (ent = readdir(proc)) != NULL; ) {
+        if (!numeric(ent->d_name)) continue;
+        pid_t tgid = atoi(ent->d_name);
+
+        snprintf(path, sizeof(path), "/proc/%d/task", (int)tgid);
+        DIR* dir = sysfs_opendir(path);
+        if (dir == NULL) continue;
+
+        for (struct dirent* t; (t = readdir(dir)) != NULL; ) {
+            if (!numeric(t->d_name)) continue;
+            pid_t tid = atoi(t->d_name);
+
+            while (old < task_count && (tasks[old].tgid < tgid || (tasks[old].tgid == tgid && tasks[old].tid < tid))) {
+                if (tasks[old].fd >= 0) close(tasks[old].fd);
+                old++;
+            }
+
+            int known = old < task_count && tasks[old].tgid == tgid && tasks[old].tid == tid;
+            keep_task(&n, known ? &tasks[old++] : NULL, tgid, tid, slot);
+        }
+
+        closedir(dir);
+    }
+
+    closedir(proc);
+
+    for (; old < task_count; old++)
+        if (tasks[old].fd >= 0) close(tasks[old].fd);
+
+    struct task* swap = tasks;
+    tasks = spare;
+    spare = swap;
+    task_count = n;
+}
+
+static void keep_task (int* n, struct task* old, pid_t tgid, pid_t tid, int slot) {
+    char path[64];
+
+    if (*n == task_max) {
+        task_max = task_max ? task_max * 2 : 512;
+        spare = realloc(spare, task_max * sizeof(*spare));
+
+        // The live table has to be able to take as many next time round.
+        struct task* grown = realloc(tasks, task_max * sizeof(*tasks));
+        if (old != NULL) old = grown + (old - tasks);
+        tasks = grown;
+    }
+
+    struct task* t = &spare[(*n)++];
+
+    if (old != NULL) {
+        *t = *old;
+        if (read_schedstat(t, slot) == 0) return;
+
+        // Gone since readdir(), or a new thread that has the same id.
+        close(t->fd);
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->tgid = tgid;
+    t->tid = tid;
+    t->born = taken;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", (int)tgid, (int)tid);
+    t->fd = sysfs_open(path, O_RDONLY | O_CLOEXEC);
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)tgid);
+    if (sysfs_read(path, t->comm, sizeof(t->comm)) < 0) snprintf(t->comm, sizeof(t->comm), "?");
+
+    if (t->fd < 0 || read_schedstat(t, slot) < 0) {
+        if (t->fd >= 0) close(t->fd);
+        t->fd = -1;
+        (*n)--;
+    }
+}
+
+static int read_schedstat (struct task* t, int slot) {
+    char buf[128];
+
+    // "run_ns wait_ns timeslices": the last counts each time it was scheduled in, which for
+    // threads that sleep is each time they were woken.
+    if (read_at(t->fd, buf, sizeof(buf)) <= 0) return -1;
+
+    char* p = buf;
+    t->ns[slot] = strtoull(p, &p, 10);
+    strtoull(p, &p, 10);
+    t->runs[slot] = strtoull(p, &p, 10);
+    return 0;
+}
+
+static ssize_t read_at (int fd, char* buf, size_t len) {
+    ssize_t got = pread(fd, buf, len - 1, 0);
+    buf[got > 0 ? got : 0] = 0;
+    return got;
+}
+
+static double between (const struct timespec* a, const struct timespec* b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static int numeric (const char* name) {
+    if (!*name) return 0;
+    for (; *name; name++)
+        if (!isdigit((unsigned char)*name)) return 0;
+
+    return 1;
+}
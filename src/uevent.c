@@ -0,0 +1,82 @@
+/* pwr: Power-saving-mode controller for linux laptops.
+ * Copyright 2018 Ethan McTague.
+ * Licensed under the MIT license. See LICENSE for full license text.
+ * https://github.com/emctague/pwr
+ */
+
+// Kernel uevents and AC adapter state.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+#include <glob.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pwr.h"
+
+static int read_attr (const char* dir, const char* name, char* out, size_t len);
+
+
+int uevent_open () {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return -1;
+
+    // Group 1 carries the kernel's own events, before udev has seen them.
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int uevent_read (int fd, const char* const* subsystems) {
+    char buf[8192];
+    int matched = 0;
+    ssize_t len;
+
+    // Drain everything queued; one match is enough.
+    while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[len] = 0;
+
+        // "action@devpath", then nul-separated KEY=value pairs.
+        for (char* p = buf; p < buf + len; p += strlen(p) + 1) {
+            if (strncmp(p, "SUBSYSTEM=", 10)) continue;
+            for (int i = 0; subsystems[i] != NULL; i++)
+                if (!strcmp(p + 10, subsystems[i])) matched = 1;
+        }
+    }
+
+    return matched;
+}
+
+int ac_online () {
+    glob_t results = { 0 };
+    int online = -1;
+    char value[32];
+
+    if (sysfs_glob("/sys/class/power_supply/*", 0, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc; i++) {
+            if (read_attr(results.gl_pathv[i], "type", value, sizeof(value)) < 0) continue;
+            if (strcmp(value, "Mains") && strcmp(value, "USB")) continue;
+            if (read_attr(results.gl_pathv[i], "online", value, sizeof(value)) < 0) continue;
+
+            // Any one adapter being plugged in counts.
+            if (online < 0) online = 0;
+            if (value[0] == '1') online = 1;
+        }
+    }
+
+    globfree(&results);
+    return online;
+}
+
+
+static int read_attr (const char* dir, const char* name, char* out, size_t len) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return sysfs_read(path, out, len);
+}